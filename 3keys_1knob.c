@@ -46,6 +46,13 @@
 #include <config.h>                         // user configurations
 #include <system.h>                         // system functions
 #include <delay.h>                          // delay functions
+#include <timer.h>                          // tick timer functions
+#include <encoder.h>                        // rotary encoder functions
+#include <debounce.h>                       // switch debouncer
+#include <events.h>                         // input event queue
+#include <dataflash.h>                      // data flash functions
+#include <macro.h>                          // macro interpreter
+#include <codeflash.h>                      // code flash keymap region
 #include <neo.h>                            // NeoPixel functions
 #include <usb_conkbd.h>                     // USB HID consumer keyboard functions
 
@@ -55,6 +62,10 @@ void USB_ISR(void) __interrupt(INT_NO_USB) {
   USB_interrupt();
 }
 
+void TMR2_ISR(void) __interrupt(INT_NO_TMR2) {
+  TMR_interrupt();
+}
+
 // ===================================================================================
 // NeoPixel Functions
 // ===================================================================================
@@ -71,8 +82,19 @@ enum Event {
   KEY23,
   KEY13,
   ENC_SW_CW,
-  ENC_SW_CCW
+  ENC_SW_CCW,
+  KEY1_HOLD,                              // tap/hold events, see taphold_update()
+  KEY2_HOLD,
+  KEY3_HOLD,
+  KEY1_DOUBLE,
+  KEY2_DOUBLE,
+  KEY3_DOUBLE,
+  CHORD,                                  // chord events, see parse_chord()
+  CHORD_CW,
+  CHORD_CCW,
+  EVENTS                                  // number of events
 };
+#define LAYER_EVENTS ENC_SW_CCW           // events in a layer record, NONE has none
 
 struct RGB {
   uint8_t r;
@@ -80,29 +102,10 @@ struct RGB {
   uint8_t b;
 };
 
-struct Chars {
-  char mod1;
-  char char1;
-  char mod2;
-  char char2;
-  char mod3;
-  char char3;
-  char modSW;
-  char charSW;
-  char modCW;
-  char charCW;
-  char modCCW;
-  char charCCW;
-  char mod12;
-  char char12;
-  char mod23;
-  char char23;
-  char mod13;
-  char char13;
-  char swcharCW;
-  char swcharCCW;
-  char swmodCW;
-  char swmodCCW;
+// Action of an event: modifier byte and character, see get_type()
+struct Action {
+  uint8_t mod;
+  uint8_t key;
 };
 
 __idata struct RGB neo[4];
@@ -114,10 +117,129 @@ __idata uint8_t layer = 0;
 __idata uint8_t max_layer = 0;
 __idata uint8_t show_mode = 0;
 __idata uint8_t option[4] = { 0 };
-__idata struct Chars chars[4];
+__code uint8_t poll_interval[8] = { 10, 1, 2, 4, 8, 10, 10, 10 };  // in ms
+
+// Option byte of each layer
+#define OPT_VALUE   0x3F  // sequence delay (layers 1-3)
+#define OPT_LAYERS  0x03  // bits 0-1: max layer (layer 0)
+#define OPT_POLL    2     // bits 2-4: USB polling interval (layer 0)
+#define OPT_ACCEL   6     // bits 6-7: encoder acceleration curve
+
+// Configuration over USB: vendor feature report HID_FEATURE_ID of 32 bytes,
+// ID, command (status when read), offset, count, up to CFG_CHUNK data bytes
+#define CFG_CHUNK     28
+#define CFG_CMD_READ  1   // select bytes returned by the next read
+#define CFG_CMD_WRITE 2   // write bytes into staging buffer
+#define CFG_CMD_APPLY 3   // check and use staging buffer
+#define CFG_CMD_SAVE  4   // check and use staging buffer, then save it to data flash
+#define CFG_CMD_KMAP_READ  5  // select keymap region bytes returned by the next read
+#define CFG_CMD_KMAP_WRITE 6  // write up to KMAP_BLOCK bytes into keymap region
+#define CFG_CMD_STATS 7   // select statistics returned by the next read
+#define CFG_CMD_KMAP_APPLY 8  // check and use keymap region, configuration is unchanged
+#define CFG_STATS     9   // input and report queue overflows, chatter per switch,
+                          // data flash bytes written (the only command of a baked build)
+#define CFG_OK        0
+#define CFG_BUSY      1   // apply or save in progress
+#define CFG_ERROR     2   // bad command or configuration rejected
+
+__xdata uint8_t cfg_offset = 0;            // bytes returned by read
+__xdata uint8_t cfg_count = CFG_CHUNK;
+__xdata uint8_t cfg_status = CFG_OK;       // result of last command
+__bit cfg_stats = 0;                       // reads return statistics
+
+#ifdef KEYMAP_BAKED
+// Keymap baked into the firmware by "make bake": tables indexed by layer and event,
+// data flash is not used and the keymap can not be changed over USB
+#include <keymap_baked.h>
+#else
+
+// Configuration in data flash, version 2: 8-byte header, then a record per layer
+#define CFG_MAGIC   0     // bytes 0-1: '3', 'K'
+#define CFG_VERSION 2     // byte 2: layout version
+#define CFG_STATE   3     // byte 3: layer and max layer at power-up
+#define CFG_CRC     4     // bytes 4-5: CRC-16 of all layer records, low byte first
+#define CFG_SAVES   6     // bytes 6-7: configurations saved from host, low byte first
+#define CFG_HEADER  8     // header size
+#define CFG_LAYER   30    // record size: keys, foreground, background, fade, option
+#define CFG_MAGIC0  '3'
+#define CFG_MAGIC1  'K'
+#define CFG_VERSION2 2
+#define CFG_STATE_SAVED 0x80  // state byte: bits 0-1 base layer, bits 2-3 max layer
+
+__xdata uint8_t config[DFL_SIZE];          // copy of data flash, checked
+__xdata uint8_t cfg_stage[DFL_SIZE];       // written by host, used once it passes the check
+__bit cfg_saved = 0;                       // data flash holds a valid version 2 config
+__idata uint8_t saved_state = 0;           // layer and max layer known to data flash
+
+volatile __idata uint8_t cfg_request = 0;  // apply or save requested by host
+__bit cfg_legacy = 0;                      // buffer holds legacy layout
+__bit cfg_kmap = 0;                        // reads return keymap region
+
+// Keymap region in code flash: 8-byte header, then layer records in the version 2
+// layout, grouped in banks of four layers, then a macro table up to the end
+#define KMAP_MAGIC  0     // bytes 0-1: 'K', 'M'
+#define KMAP_LAYERS 2     // byte 2: number of layer records
+#define KMAP_FLAGS  3     // byte 3: sections after the layer records
+#define KMAP_TAPHOLD 0x01 // tap/hold section (TH_SIZE bytes) follows the layer records
+#define KMAP_CHORDS 0x02  // chord section (CH_SIZE bytes) follows
+#define KMAP_LENGTH 4     // bytes 4-5: bytes after header, low byte first
+#define KMAP_CRC    6     // bytes 6-7: CRC-16 of bytes after header, low byte first
+#define KMAP_HEADER 8
+#define KMAP_BLOCK  16    // region offsets in feature reports are in blocks of 16 bytes
+
+__idata uint8_t kmap_layers = 0;           // layers in code flash, 0 if none or invalid
+__idata uint8_t bank = 0;                  // bank of layers in use
+__xdata uint16_t kmap_addr;                // pending write from host
+__xdata uint8_t kmap_count;
+__xdata uint8_t kmap_chunk[KMAP_BLOCK];
+
+// Used when data flash is blank or corrupt: copy, paste, mute and volume
+__code uint8_t config_default[CFG_HEADER + CFG_LAYER] = {
+  CFG_MAGIC0, CFG_MAGIC1, CFG_VERSION2, 0, 0, 0, 0, 0,
+  0x01, 'c', 0x01, 'v', 0x01, 'x',          // keys 1-3: ctrl+c, ctrl+v, ctrl+x
+  0xFF, 0xE2, 0xFF, 0xE9, 0xFF, 0xEA,       // encoder: mute, volume up, volume down
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0,             // no combos, no encoder pressed turns
+  0xFF, 0x16, 0x00,                         // foreground
+  0x0C, 0x01, 0x00,                         // background
+  1,                                        // fade step
+  0                                         // option: single layer, 10 ms polling
+};
+#endif
+
+// Relative actions (modifier byte), character is signed steps per event
+#define MOD_PAN     0xFD  // horizontal scroll
+#define MOD_WHEEL   0xFE  // vertical scroll
 
-__idata const int8_t encoder_factor[] = { 0, 1, -1, 2, -1, 0, -2, 1, 1, -2, 0, -1, 2, -1, 1, 0 };
-__idata int8_t encoder_value = 0;
+// Usage actions (modifier byte), character is the low byte of the usage
+#define MOD_CONSUMER 0xF8 // 0xF8-0xFB: consumer usage, bits 0-1 are usage bits 8-9
+#define MOD_SYSTEM  0xF7  // system control usage
+#define MOD_RAW     0xF0  // keyboard usage, sent without ASCII translation
+#define MOD_MACRO   0xF1  // macro number, see include/macro.c
+#define MOD_BANK    0xF2  // switch bank: 0 data flash, 1 and up code flash layers
+#define MOD_LAYER   0xF3  // layer stack action, see LAYER_HOLD
+
+#ifndef KEYMAP_BAKED
+__idata struct Action keymap[4][LAYER_EVENTS];  // by layer and event - 1
+#endif
+
+// Tap/hold section of the keymap region: timing, then the actions of KEY1_HOLD to
+// KEY3_DOUBLE for layers 0-3 of every bank
+#define TH_HOLD     0     // bytes 0-2: hold threshold of keys 1-3 (* 10 ms)
+#define TH_DOUBLE   3     // bytes 3-5: double tap window of keys 1-3 (* 10 ms)
+#define TH_ACTIONS  8
+#define TH_EVENTS   (KEY3_DOUBLE - KEY1_HOLD + 1)
+#define TH_SIZE     (TH_ACTIONS + 4 * TH_EVENTS * 2)
+
+__code uint8_t *th_table = 0;              // tap/hold section, 0 if none
+
+// Chord section of the keymap region: for layers 0-3 of every bank and each mask of
+// switches held (bits as DEB_state), the actions of CHORD, CHORD_CW and CHORD_CCW
+#define CH_MASKS    16
+#define CH_SIZE     (4 * CH_MASKS * 3 * 2)
+
+__code uint8_t *ch_table = 0;              // chord section, 0 if none
+__idata uint8_t chord_layers = 0;          // layers with chord actions, bit per layer
+__idata uint8_t chord_mask;                // switches of the chord being sent
 
 // Update NeoPixels
 void NEO_update(void) {
@@ -175,81 +297,213 @@ void type_uint(uint8_t n) {
 
 void type_delimit() { KBD_type(','); KBD_type(' '); }
 
+// Layer stack: the highest active layer is used, the base layer if none is active.
+// Held layers drop when the switches of their event are released, one-shot layers
+// after the next event.
+#define LAYER_HOLD    0x10  // layer action 0x1n: layer n while held
+#define LAYER_TOGGLE  0x20  // 0x2n: toggle layer n
+#define LAYER_ONESHOT 0x30  // 0x3n: layer n for the next event
+#define LAYER_BASE    0x40  // 0x4n: clear stack, base layer n
+
+__idata uint8_t layer_base = 0;
+__idata uint8_t layer_on = 0;              // toggled layers, bit per layer
+__idata uint8_t layer_held = 0;            // momentary layers
+__idata uint8_t layer_shot = 0;            // one-shot layers
+__xdata uint8_t layer_keys[4];             // switches holding each momentary layer
+__code uint8_t layer_top[16] = { 0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3 };
+__code uint8_t event_switches[EVENTS] = {
+  0, DEB_KEY1, DEB_KEY2, DEB_KEY3, DEB_ENC_SW, 0, 0,
+  DEB_KEY1 | DEB_KEY2, DEB_KEY2 | DEB_KEY3, DEB_KEY1 | DEB_KEY3, DEB_ENC_SW, DEB_ENC_SW,
+  DEB_KEY1, DEB_KEY2, DEB_KEY3, DEB_KEY1, DEB_KEY2, DEB_KEY3,
+  0, 0, 0                                   // chords: chord_mask
+};
+
+// Use the top of the layer stack, whatever max_layer is (it only limits the
+// layers the knob switch cycles through)
+void layer_update(void) {
+  uint8_t stack = layer_on | layer_held | layer_shot;
+  layer = stack ? layer_top[stack] : layer_base;
+}
+
+// Clear the layer stack and switch to base layer n
+void layer_to(uint8_t n) {
+  layer_base = n & 3;
+  layer_on = layer_held = layer_shot = 0;
+  layer_update();
+}
+
+// Check if event ev (KEY1-3, ENC_SW) holds a layer on this layer. It is sent when
+// the switch goes down, since the layer would be gone by the time it is released.
+uint8_t layer_hold_bound(enum Event ev) {
+  struct Action a;
+#ifdef KEYMAP_BAKED
+  if (layer >= BAKED_LAYERS) { return 0; }
+  a = baked_keys[layer][ev - 1];
+#else
+  a = keymap[layer][ev - 1];
+#endif
+  return (a.mod == MOD_LAYER) && ((a.key & 0xF0) == LAYER_HOLD);
+}
+
+// Layer action of event
+void layer_action(enum Event ev, uint8_t a) {
+  uint8_t n = a & 3;
+  uint8_t bit = 1 << n;
+  switch (a & 0xF0) {
+    case LAYER_HOLD:                        // combos and chords are sent on release
+      if (((ev >= KEY12) && (ev <= KEY13)) || (ev == CHORD)) { return; }
+      layer_held |= bit;
+      layer_keys[n] = (ev >= CHORD) ? chord_mask : event_switches[ev];
+      break;
+    case LAYER_TOGGLE:  layer_on ^= bit; break;
+    case LAYER_ONESHOT: layer_shot |= bit; break;
+    case LAYER_BASE:    layer_base = n; layer_on = layer_held = layer_shot = 0; break;
+  }
+  layer_update();
+  show_mode = 60;
+}
+
+// Drop momentary layers whose switches are all released
+void layer_release(uint8_t hold) {
+  uint8_t n;
+  for (n = 0; n <= 3; n++) {
+    if ((layer_held & (1 << n)) && !(hold & layer_keys[n])) { layer_held &= ~(1 << n); }
+  }
+  layer_update();
+}
+
 void parse_layer(int8_t dir) {
+  uint8_t n = layer_base;
   if (max_layer > 3) { max_layer = 3; }
-  if (dir == 0) { layer = 0; return; }
+  if (dir == 0) { layer_to(0); return; }
   switch (max_layer) {
     case 0:
-      layer = 0;
+      n = 0;
       break;
     case 1:
-      layer = 3;
+      n = 3;
       break;
     case 2:
-      if (dir > 0) { layer = 2; return; }
-      if (dir < 0) { layer = 3; return; }
+      n = (dir > 0) ? 2 : 3;
       break;
     case 3:
-      layer += dir;
-      if (layer > 3) { layer = 1; }
-      if (layer < 1) { layer = 3; }
+      n += dir;
+      if (n > 3) { n = 1; }
+      if (n < 1) { n = 3; }
       break;
   }
+  layer_to(n);
+}
+
+uint8_t get_type(enum Event ev, uint8_t n, uint8_t count);
+#ifndef KEYMAP_BAKED
+void load_bank(uint8_t b);
+#endif
+
+// Sequence in progress: event still to be sent from layers seq_layer and up
+__xdata uint8_t seq_layer = 0;             // next layer, 0 if idle
+__xdata uint8_t seq_event;
+__xdata uint8_t seq_count;
+__xdata uint16_t seq_since;                // time of last step
+
+// Send steps of a sequence whose delay (option value * 100 ms) has passed,
+// or all remaining steps at once if flush is set
+void run_sequence(uint8_t flush) {
+  while (seq_layer && (seq_layer <= 3 - max_layer)) {
+    if (!flush && ((uint16_t)(TMR_millis() - seq_since) < (option[seq_layer] & OPT_VALUE) * 100)) {
+      return;                               // wait, checked again from main loop
+    }
+    get_type(seq_event, seq_layer, seq_count);
+    seq_since = TMR_millis();
+    seq_layer++;
+  }
+  seq_layer = 0;
+}
+
+// Send event up to count times, returns how many were sent.
+// Relative actions send all of them in a single report, others only one.
+uint8_t parse_steps(enum Event ev, uint8_t count) {
+  uint8_t shot = layer_shot;                // one-shot layers used up by this event
+  uint8_t stack = layer_on | layer_held | layer_shot;
+  if (seq_layer) { run_sequence(1); }       // finish last sequence first
+  count = get_type(ev, layer, count);
+  if ((layer == 0) && !stack && (max_layer <= 2)) {  // sequences from the base layer only
+    seq_event = ev; seq_count = count; seq_layer = 1; seq_since = TMR_millis();
+    run_sequence(0);
+  }
+  if (shot) { layer_shot &= ~shot; layer_update(); }
+  return count;
 }
 
-void seq_delay(uint8_t n) {
-  __idata uint8_t i;
-  if (n < 1) { return; }
-  if (n > 3) { return; }
-  for (i = 0; i < option[n]; i++) { DLY_ms(100); }
-}
-
-void mod_type(char c, uint8_t mod);
-void get_type(enum Event ev, uint8_t n);
-void parse_type(enum Event ev) {
-  get_type(ev, layer);
-  if (layer == 0) {
-    if (max_layer <= 2) { seq_delay(1); get_type(ev, 1); }
-    if (max_layer <= 1) { seq_delay(2); get_type(ev, 2); }
-    if (max_layer <= 0) { seq_delay(3); get_type(ev, 3); }
-  }
-}
-
-void get_type(enum Event ev, uint8_t n) {
-  char c = 0;
-  uint8_t mod = 0;
-  switch (ev) {
-    case KEY1:
-      c = chars[n].char1; mod = chars[n].mod1; break;
-    case KEY2:
-      c = chars[n].char2; mod = chars[n].mod2; break;
-    case KEY3:
-      c = chars[n].char3; mod = chars[n].mod3; break;
-    case ENC_SW:
-      c = chars[n].charSW; mod = chars[n].modSW; break;
-    case ENC_CW:
-      c = chars[n].charCW; mod = chars[n].modCW; break;
-    case ENC_CCW:
-      c = chars[n].charCCW; mod = chars[n].modCCW; break;
-    case KEY12:
-      c = chars[n].char12; mod = chars[n].mod12; break;
-    case KEY23:
-      c = chars[n].char23; mod = chars[n].mod23; break;
-    case KEY13:
-      c = chars[n].char13; mod = chars[n].mod13; break;
-    case ENC_SW_CW:
-      c = chars[n].swcharCW; mod = chars[n].swmodCW; break;
-    case ENC_SW_CCW:
-      c = chars[n].swcharCCW; mod = chars[n].swmodCCW; break;
-  }
-  if (c == 0) { return; }
+void parse_type(enum Event ev) { parse_steps(ev, 1); }
+
+// Send action of event in layer n (event is never NONE)
+uint8_t get_type(enum Event ev, uint8_t n, uint8_t count) {
+  uint8_t c;                                // unsigned: 0xE2 must not become 0xFFE2
+  uint8_t mod;
+  int16_t rel;
+  __code uint8_t *p;
+  if (ev >= KEY1_HOLD) {                    // tap/hold and chord events are read from code flash
+    if (ev >= CHORD) {
+      if (!ch_table) { return 1; }
+      p = ch_table + ((n * CH_MASKS + chord_mask) * 3 + (ev - CHORD)) * 2;
+    } else {
+      if (!th_table) { return 1; }
+      p = th_table + TH_ACTIONS + (n * TH_EVENTS + (ev - KEY1_HOLD)) * 2;
+    }
+    mod = p[0];
+    c = p[1];
+  } else {
+#ifdef KEYMAP_BAKED
+  if (n >= BAKED_LAYERS) { return 1; }     // empty layer, not baked
+  mod = baked_keys[n][ev - 1].mod;
+  c = baked_keys[n][ev - 1].key;
+#else
+  mod = keymap[n][ev - 1].mod;
+  c = keymap[n][ev - 1].key;
+#endif
+  }
+  if (c == 0) { return 1; }
+  if ((mod == MOD_WHEEL) || (mod == MOD_PAN)) {
+    rel = (int16_t)(int8_t)c * count;
+    if (rel > 127) { rel = 127; }
+    if (rel < -127) { rel = -127; }
+    if (mod == MOD_WHEEL) { MSE_scroll(rel, 0); } else { MSE_scroll(0, rel); }
+    return count;
+  }
+  if ((mod & 0xFC) == MOD_CONSUMER) {
+    CON_type(((uint16_t)(mod & 0x03) << 8) | c);
+    return 1;
+  }
+  if (mod == MOD_SYSTEM) {
+    SYS_type(c);
+    return 1;
+  }
+  if (mod == MOD_RAW) {
+    KBD_chordRaw(c, 0);
+    return 1;
+  }
+  if (mod == MOD_MACRO) {
+    MAC_start(c);
+    return 1;
+  }
+  if (mod == MOD_LAYER) {
+    layer_action(ev, c);
+    return 1;
+  }
+  if (mod == MOD_BANK) {                    // nothing to send, no banks in a baked build
+#ifndef KEYMAP_BAKED
+    load_bank(c);
+#endif
+    return 1;
+  }
   if (mod == 0xFF) {
     if (c >= 0xF0) {
       switch (c) {
         case 0xF0: parse_layer(0); break;
-        case 0xF1: layer = 1; break;
-        case 0xF2: layer = 2; break;
-        case 0xF3: layer = 3; break;
+        case 0xF1: layer_to(1); break;
+        case 0xF2: layer_to(2); break;
+        case 0xF3: layer_to(3); break;
         case 0xF5: max_layer = 0; break;
         case 0xF6: max_layer = 1; break;
         case 0xF7: max_layer = 2; break;
@@ -258,108 +512,604 @@ void get_type(enum Event ev, uint8_t n) {
         case 0xFB: parse_layer(1); break;
         case 0xFD: KBD_type('0' + (layer % 10)); break;
       }
+      layer_update();                       // max layer may have changed
       if (c != 0xFF) { show_mode = 60; }
     } else {
       CON_type(c);
     }
+    return 1;
+  }
+  KBD_chord(c, mod);
+  return 1;
+}
+
+// Replace unset colours and fade steps with defaults
+void check_colors(void) {
+  uint8_t i;
+  for (i = 0; i <= 3; i++) {
+    if ((neofg[i].r | neofg[i].g | neofg[i].b) == 0) {
+      neofg[i].r = 0xFF; neofg[i].g = 0x16;
+    }
+    if ((neobg[i].r | neobg[i].g | neobg[i].b) == 0) {
+      neobg[i].r = 0xC; neobg[i].g = 0x1;
+    }
+    if (neofade[i].r == 0) { neofade[i].r = 1; }
+    if (neofade[i].g == 0) { neofade[i].g = 1; }
+    if (neofade[i].b == 0) { neofade[i].b = 1; }
+  }
+}
+
+// Fill statistics into feature report (called from USB interrupt)
+#pragma save
+#pragma nooverlay
+void get_stats(__xdata uint8_t *buf) {
+  uint8_t i;
+  buf[4] = (uint8_t)EVT_overflow; buf[5] = EVT_overflow >> 8;
+  for (i = 0; i < DEB_COUNT; i++) { buf[6 + i] = DEB_chatter[i]; }
+  buf[10] = (uint8_t)DFL_written; buf[11] = DFL_written >> 8;
+  buf[12] = HID_overflow;
+}
+#pragma restore
+
+#ifdef KEYMAP_BAKED
+// Feature report of a baked build, statistics only (called from USB interrupt)
+#pragma save
+#pragma nooverlay
+uint8_t config_get_report(__xdata uint8_t *buf) {
+  uint8_t i;
+  buf[0] = HID_FEATURE_ID;
+  buf[1] = cfg_status;
+  buf[2] = 0;
+  buf[3] = cfg_stats ? CFG_STATS : 0;
+  for (i = 0; i < CFG_CHUNK; i++) { buf[4 + i] = 0; }
+  if (cfg_stats) { get_stats(buf); }
+  return HID_FEATURE_SIZE;
+}
+
+void config_set_report(__xdata uint8_t *buf) {
+  cfg_stats = (buf[1] == CFG_CMD_STATS);
+  cfg_status = cfg_stats ? CFG_OK : CFG_ERROR;
+}
+#pragma restore
+
+// Load colours and options of the baked layers
+void load_baked(void) {
+  uint8_t i;
+  __code uint8_t *p;
+  for (i = 0; i < BAKED_LAYERS; i++) {
+    p = baked_layers[i];
+    neofg[i].r = p[0]; neofg[i].g = p[1]; neofg[i].b = p[2];
+    neobg[i].r = p[3]; neobg[i].g = p[4]; neobg[i].b = p[5];
+    neofade[i].r = neofade[i].g = neofade[i].b = p[6];
+    option[i] = p[7];
+  }
+  #ifdef BAKED_TAPHOLD
+  th_table = baked_taphold;
+  #endif
+  #ifdef BAKED_CHORDS
+  ch_table = baked_chords;
+  chord_layers = BAKED_CHORDS;
+  #endif
+  #ifdef BAKED_MACROS
+  MAC_setTable(baked_macros, sizeof(baked_macros));
+  #endif
+}
+#else
+// Load layer from version 2 record, in data or code flash
+void load_layer(uint8_t n, uint8_t *p) {
+  uint8_t i;
+  __idata uint8_t *c = (__idata uint8_t *)keymap[n];
+  for (i = 0; i < (KEY13 << 1); i++) { *c++ = *p++; }  // KEY1 to KEY13 in event order
+  keymap[n][ENC_SW_CW - 1].key = *p++;  keymap[n][ENC_SW_CCW - 1].key = *p++;
+  keymap[n][ENC_SW_CW - 1].mod = *p++;  keymap[n][ENC_SW_CCW - 1].mod = *p++;
+  neofg[n].r = *p++; neofg[n].g = *p++; neofg[n].b = *p++;
+  neobg[n].r = *p++; neobg[n].g = *p++; neobg[n].b = *p++;
+  neofade[n].r = neofade[n].g = neofade[n].b = *p++;
+  option[n] = *p;
+}
+
+// Load layer from legacy (version 1) record
+void load_legacy(uint8_t n, __xdata uint8_t *p) {
+  uint8_t i;
+  __idata uint8_t *c = (__idata uint8_t *)keymap[n];
+  for (i = 0; i < (ENC_CCW << 1); i++) { *c++ = p[i]; }    // KEY1 to ENC_CCW
+  neofg[n].r = p[12]; neofg[n].g = p[13]; neofg[n].b = p[14];
+  option[n] = p[15];
+  for (i = 16; i < 22; i++) { *c++ = p[i]; }               // KEY12 to KEY13
+  keymap[n][ENC_SW_CW - 1].key = p[22]; keymap[n][ENC_SW_CCW - 1].key = p[23];
+  neofade[n].r = p[24]; neofade[n].g = p[25]; neofade[n].b = p[26];
+  keymap[n][ENC_SW_CW - 1].mod = p[27];
+  neobg[n].r = p[28]; neobg[n].g = p[29]; neobg[n].b = p[30];
+  keymap[n][ENC_SW_CCW - 1].mod = p[31];
+}
+
+// Check version 2 configuration in buf, returns 0 if invalid
+uint8_t check_config(__xdata uint8_t *buf) {
+  uint16_t crc;
+  if ((buf[CFG_MAGIC] != CFG_MAGIC0) || (buf[CFG_MAGIC + 1] != CFG_MAGIC1)) { return 0; }
+  if (buf[CFG_VERSION] != CFG_VERSION2) { return 0; }
+  crc = DFL_crc(buf + CFG_HEADER, DFL_SIZE - CFG_HEADER);
+  return (buf[CFG_CRC] == (uint8_t)crc) && (buf[CFG_CRC + 1] == (uint8_t)(crc >> 8));
+}
+
+// Start staging from the configuration in use, dropping writes not applied
+void reset_stage(void) {
+  uint8_t i;
+  for (i = 0; i < DFL_SIZE; i++) { cfg_stage[i] = config[i]; }
+}
+
+// Use layers of configuration buffer
+void use_config(void) {
+  uint8_t i;
+  for (i = 0; i <= 3; i++) {
+    if (cfg_legacy) { load_legacy(i, config + i * 32); }
+    else { load_layer(i, config + CFG_HEADER + i * CFG_LAYER); }
+  }
+}
+
+// Load configuration from data flash, falls back to defaults and returns 0 if invalid
+uint8_t load_config(void) {
+  uint8_t i;
+  uint8_t valid = 1;
+
+  DFL_read(config);
+  if ((config[CFG_MAGIC] == CFG_MAGIC0) && (config[CFG_MAGIC + 1] == CFG_MAGIC1)) {
+    valid = check_config(config);           // unknown version or corrupt?
+    cfg_saved = valid;
+  } else {
+    cfg_legacy = 1;
+    use_config();
+    if ((keymap[0][KEY1 - 1].key | keymap[0][KEY2 - 1].key | keymap[0][KEY3 - 1].key) == 0) {
+      valid = 0;                            // blank
+    }
+    else { return 1; }
+  }
+
+  if (!valid) {
+    for (i = 0; i < DFL_SIZE; i++) {
+      config[i] = (i < sizeof(config_default)) ? config_default[i] : 0;
+    }
+  }
+  cfg_legacy = 0;
+  use_config();
+  return valid;
+}
+
+// Stop using the keymap region, before it is rewritten or when it is invalid
+void drop_kmap(void) {
+  kmap_layers = 0;
+  th_table = 0;
+  ch_table = 0;
+  chord_layers = 0;
+  MAC_setTable(0, 0);                       // built-in macros, stops a running one
+}
+
+// Check keymap region in code flash and use its macros, returns 1 if valid
+uint8_t load_kmap(void) {
+  uint16_t len = CFL_data[KMAP_LENGTH] | ((uint16_t)CFL_data[KMAP_LENGTH + 1] << 8);
+  uint16_t layers = (uint16_t)CFL_data[KMAP_LAYERS] * CFG_LAYER;
+  uint16_t chords;                          // start of chord section
+  uint16_t macros;                          // start of macro table
+  uint16_t crc;
+  uint8_t i;
+
+  drop_kmap();
+  if ((CFL_data[KMAP_MAGIC] != 'K') || (CFL_data[KMAP_MAGIC + 1] != 'M')) { return 0; }
+  chords = layers + ((CFL_data[KMAP_FLAGS] & KMAP_TAPHOLD) ? TH_SIZE : 0);
+  macros = chords + ((CFL_data[KMAP_FLAGS] & KMAP_CHORDS) ? CH_SIZE : 0);
+  if ((len > CFL_SIZE - KMAP_HEADER) || (macros > len)) { return 0; }
+  crc = DFL_crc(CFL_data + KMAP_HEADER, len);
+  if ((CFL_data[KMAP_CRC] != (uint8_t)crc) || (CFL_data[KMAP_CRC + 1] != (uint8_t)(crc >> 8))) {
+    return 0;                               // corrupt or half written
+  }
+  kmap_layers = CFL_data[KMAP_LAYERS];
+  if (chords > layers) { th_table = CFL_data + KMAP_HEADER + layers; }
+  if (macros > chords) {
+    ch_table = CFL_data + KMAP_HEADER + chords;
+    for (i = 0; i < 4 * CH_MASKS * 3; i++) {
+      if (ch_table[i * 2 + 1]) { chord_layers |= 1 << (i / (CH_MASKS * 3)); }
+    }
+  }
+  if (len > macros) { MAC_setTable(CFL_data + KMAP_HEADER + macros, len - macros); }
+  return 1;
+}
+
+// Switch to bank of four layers: 0 is data flash, 1 and up are in code flash
+void load_bank(uint8_t b) {
+  uint8_t i, j, n;
+  __idata uint8_t *c;
+  if (b == 0) {
+    use_config();
+  } else {
+    if ((uint16_t)(b - 1) * 4 >= kmap_layers) { return; }  // no such bank
+    for (i = 0; i <= 3; i++) {
+      n = (b - 1) * 4 + i;
+      if (n < kmap_layers) {
+        load_layer(i, CFL_data + KMAP_HEADER + (uint16_t)n * CFG_LAYER);
+      } else {                              // bank not full: empty layer
+        c = (__idata uint8_t *)keymap[i];
+        for (j = 0; j < sizeof(keymap[0]); j++) { c[j] = 0; }
+        neofg[i].r = neofg[i].g = neofg[i].b = 0;
+        neobg[i].r = neobg[i].g = neobg[i].b = 0;
+        option[i] = 0;
+      }
+    }
+  }
+  bank = b;
+  check_colors();
+  max_layer = option[0] & OPT_LAYERS;
+  layer_to(0);
+  set_neo_bg(0);
+  show_mode = 60;
+}
+
+// Fill configuration feature report for host (called from USB interrupt)
+#pragma save
+#pragma nooverlay
+uint8_t config_get_report(__xdata uint8_t *buf) {
+  uint8_t i;
+  buf[0] = HID_FEATURE_ID;
+  buf[1] = (cfg_request || DFL_busy()) ? CFG_BUSY : cfg_status;
+  buf[2] = cfg_offset;
+  buf[3] = cfg_count;
+  for (i = 0; i < CFG_CHUNK; i++) {
+    if ((i >= cfg_count) || cfg_stats) { buf[4 + i] = 0; }
+    else if (cfg_kmap) { buf[4 + i] = CFL_data[(uint16_t)cfg_offset * KMAP_BLOCK + i]; }
+    else { buf[4 + i] = config[cfg_offset + i]; }
+  }
+  if (cfg_stats) { get_stats(buf); }
+  return HID_FEATURE_SIZE;
+}
+
+// Handle configuration feature report from host (called from USB interrupt)
+void config_set_report(__xdata uint8_t *buf) {
+  uint8_t i;
+  uint8_t offset = buf[2];
+  uint8_t count = buf[3];
+  cfg_status = CFG_ERROR;
+  if (cfg_request || DFL_busy()) { return; }  // still busy with last request
+  if (count > CFG_CHUNK) { return; }
+  if (buf[1] >= CFG_CMD_KMAP_READ) {        // keymap region
+    if ((uint16_t)offset * KMAP_BLOCK + count > CFL_SIZE) { return; }
+  } else {                                  // data flash
+    if ((uint16_t)offset + count > DFL_SIZE) { return; }
+  }
+  switch (buf[1]) {
+    case CFG_CMD_READ:
+    case CFG_CMD_KMAP_READ:
+      cfg_offset = offset; cfg_count = count;
+      cfg_kmap = (buf[1] == CFG_CMD_KMAP_READ);
+      cfg_stats = 0;
+      break;
+    case CFG_CMD_STATS:
+      cfg_offset = 0; cfg_count = CFG_STATS;
+      cfg_stats = 1;
+      break;
+    case CFG_CMD_WRITE:
+      for (i = 0; i < count; i++) { cfg_stage[offset + i] = buf[4 + i]; }
+      break;
+    case CFG_CMD_KMAP_WRITE:
+      if ((count > KMAP_BLOCK) || (count & 1)) { return; }  // whole words only
+      for (i = 0; i < count; i++) { kmap_chunk[i] = buf[4 + i]; }
+      kmap_addr = (uint16_t)offset * KMAP_BLOCK; kmap_count = count;
+      cfg_request = CFG_CMD_KMAP_WRITE; break;  // done in main loop
+    case CFG_CMD_APPLY:
+    case CFG_CMD_SAVE:
+    case CFG_CMD_KMAP_APPLY:
+      cfg_request = buf[1]; break;          // done in main loop
+    default:
+      return;
+  }
+  cfg_status = CFG_OK;
+}
+#pragma restore
+
+// Get layer and max layer as saved in the state byte
+uint8_t get_state(void) {
+  return CFG_STATE_SAVED | (max_layer << 2) | layer_base;
+}
+
+// Save layer and max layer once they have not changed for STATE_SAVE_ms
+void save_state(void) {
+  static __xdata uint8_t last = 0;
+  static __xdata uint16_t since = 0;
+  uint8_t state = get_state();
+  if (state != last) { last = state; since = TMR_millis(); return; }
+  if (!cfg_saved || bank || (state == saved_state) || DFL_busy()) { return; }
+  if ((uint16_t)(TMR_millis() - since) < STATE_SAVE_ms) { return; }
+  saved_state = state;
+  config[CFG_STATE] = state;
+  DFL_commit(config, CFG_STATE, 1);         // state byte only, not covered by the CRC
+}
+
+// Use configuration sent by host, and save it to data flash if requested
+void update_config(void) {
+  uint8_t i;
+  if (cfg_request == CFG_CMD_KMAP_WRITE) {  // keymap region chunk
+    drop_kmap();                            // half written until APPLY
+    cfg_status = CFL_write(kmap_addr, kmap_chunk, kmap_count) ? CFG_OK : CFG_ERROR;
+    cfg_request = 0;
+    return;
+  }
+  if (cfg_request == CFG_CMD_KMAP_APPLY) {  // keymap region written, stage unused
+    cfg_status = load_kmap() ? CFG_OK : CFG_ERROR;
+    if (bank) { load_bank(((uint16_t)(bank - 1) * 4 < kmap_layers) ? bank : 0); }
+    cfg_request = 0;
     return;
   }
-  mod_type(c, mod);
-}
-
-void mod_type(char c, uint8_t mod) {
-  if (mod & 1) { KBD_press(KBD_KEY_LEFT_CTRL); }
-  if (mod & 2) { KBD_press(KBD_KEY_LEFT_SHIFT); }
-  if (mod & 4) { KBD_press(KBD_KEY_LEFT_ALT); }
-  if (mod & 8) { KBD_press(KBD_KEY_LEFT_GUI); }
-  if (mod & 16) { KBD_press(KBD_KEY_RIGHT_CTRL); }
-  if (mod & 32) { KBD_press(KBD_KEY_RIGHT_SHIFT); }
-  if (mod & 64) { KBD_press(KBD_KEY_RIGHT_ALT); }
-  if (mod & 128) { KBD_press(KBD_KEY_RIGHT_GUI); }
-  KBD_type(c);
-  if (mod & 128) { KBD_release(KBD_KEY_RIGHT_GUI); }
-  if (mod & 64) { KBD_release(KBD_KEY_RIGHT_ALT); }
-  if (mod & 32) { KBD_release(KBD_KEY_RIGHT_SHIFT); }
-  if (mod & 16) { KBD_release(KBD_KEY_RIGHT_CTRL); }
-  if (mod & 8) { KBD_release(KBD_KEY_LEFT_GUI); }
-  if (mod & 4) { KBD_release(KBD_KEY_LEFT_ALT); }
-  if (mod & 2) { KBD_release(KBD_KEY_LEFT_SHIFT); }
-  if (mod & 1) { KBD_release(KBD_KEY_LEFT_CTRL); }
-}
-
-// Read EEPROM (stolen from https://github.com/DeqingSun/ch55xduino/blob/ch55xduino/ch55xduino/ch55x/cores/ch55xduino/eeprom.c)
-uint8_t eeprom_read_byte (uint8_t addr){
-  ROM_ADDR_H = DATA_FLASH_ADDR >> 8;
-  ROM_ADDR_L = addr << 1; //Addr must be even
-  ROM_CTRL = ROM_CMD_READ;
-  return ROM_DATA_L;
+  load_kmap();                              // keymap region may have changed
+  if (check_config(cfg_stage)) {
+    for (i = 0; i < DFL_SIZE; i++) { config[i] = cfg_stage[i]; }
+    cfg_legacy = 0;
+    bank = 0;
+    use_config();
+    check_colors();
+    max_layer = option[0] & OPT_LAYERS;
+    layer_to(0);
+    saved_state = get_state();              // state byte sent by host is not used
+    set_neo_bg(0);
+    if (cfg_request == CFG_CMD_SAVE) {
+      config[CFG_STATE] = saved_state;
+      config[CFG_SAVES] = DFL_readByte(CFG_SAVES);  // keep count of saves
+      config[CFG_SAVES + 1] = DFL_readByte(CFG_SAVES + 1);
+      if (++config[CFG_SAVES] == 0) { config[CFG_SAVES + 1]++; }
+      DFL_commit(config, 0, DFL_SIZE);      // only changed bytes are written
+      cfg_saved = 1;
+    }
+    cfg_status = CFG_OK;
+  } else {
+    cfg_status = CFG_ERROR;                 // rejected, running keymap is kept
+  }
+  reset_stage();
+  cfg_request = 0;
+}
+#endif
+
+// Switch layer from macro
+void macro_layer(uint8_t n) {
+  layer_to(n);
+  show_mode = 60;
+}
+
+uint8_t has_combos(uint8_t n) {
+  if ((chord_layers >> n) & 1) { return 1; }
+#ifdef KEYMAP_BAKED
+  return (n < BAKED_LAYERS) && ((BAKED_COMBOS >> n) & 1);
+#else
+  return (keymap[n][KEY12 - 1].key | keymap[n][KEY23 - 1].key | keymap[n][KEY13 - 1].key) != 0;
+#endif
+}
+
+// Tap/hold keys: a key with a hold or double tap action on this layer is decided
+// on timestamps, tap when released before the hold threshold and not pressed again
+// within the double tap window. Other keys are sent as before, without delay.
+#define TH_IDLE     0
+#define TH_DOWN     1     // pressed: tap or hold
+#define TH_UP       2     // tapped: single or double tap
+#define TH_WAIT     3     // sent, waiting for release
+
+__idata uint8_t th_state = TH_IDLE;
+__idata uint8_t th_key;                    // key 0-2
+__idata uint16_t th_since;                 // time of press or release
+
+// Get hold action of key k on layer n, its double tap action follows 6 bytes later
+__code uint8_t *taphold_actions(uint8_t n, uint8_t k) {
+  return th_table + TH_ACTIONS + (n * TH_EVENTS + k) * 2;
+}
+
+// Get hold threshold or double tap window from tap/hold section, in ms
+uint16_t taphold_time(uint8_t i, uint16_t def) {
+  return th_table[i] ? (uint16_t)th_table[i] * 10 : def;
+}
+
+// Check if key k has a hold or double tap action on this layer
+uint8_t taphold_bound(uint8_t k) {
+  __code uint8_t *p;
+  if (!th_table) { return 0; }
+  p = taphold_actions(layer, k);
+  return (p[1] | p[7]) != 0;
+}
+
+// Send key k pressed at time since, or pass it to the tap/hold engine
+void parse_key(uint8_t k, uint16_t since) {
+  if ((th_state == TH_IDLE) && taphold_bound(k)) {
+    th_key = k; th_since = since; th_state = TH_DOWN;
+  } else {
+    parse_type(KEY1 + k);
+  }
+}
+
+// Advance the tap/hold engine with the keys held at time now, returns the key it
+// owns. Another key going down decides right away, so it is sent after this one.
+uint8_t taphold_update(uint8_t hold, uint16_t now) {
+  uint8_t bit = 1 << th_key;
+  uint16_t t = now - th_since;
+  __code uint8_t *p;
+  if (!th_table) { th_state = TH_IDLE; return 0; }  // keymap region replaced
+  p = taphold_actions(layer, th_key);
+  switch (th_state) {
+    case TH_DOWN:
+      if (!(hold & bit)) {                  // released before the hold threshold
+        if (p[7]) { th_state = TH_UP; th_since = now; }
+        else { parse_type(KEY1 + th_key); th_state = TH_IDLE; }
+      } else if ((t >= taphold_time(TH_HOLD + th_key, TAP_HOLD_ms)) || (hold & ~bit)) {
+        parse_type(p[1] ? KEY1_HOLD + th_key : KEY1 + th_key);
+        th_state = TH_WAIT;
+      }
+      break;
+    case TH_UP:
+      if (hold & bit) {                     // pressed again within the window
+        set_neo_fg(th_key + 1);
+        parse_type(KEY1_DOUBLE + th_key);
+        th_state = TH_WAIT;
+      } else if ((t >= taphold_time(TH_DOUBLE + th_key, TAP_DOUBLE_ms)) || (hold & ~bit)) {
+        parse_type(KEY1 + th_key);
+        th_state = TH_IDLE;
+      }
+      break;
+    case TH_WAIT:
+      if (!(hold & bit)) { th_state = TH_IDLE; }
+      break;
+  }
+  return (th_state == TH_IDLE) ? 0 : bit;
+}
+
+// Chords: the switches held (KEY1-3 and ENC_SW, bits as DEB_state) are looked up
+// by mask, first in the chord section, then in chord_events for the events of
+// the layer record. Rotating the knob while switches are held sends CHORD_CW and
+// CHORD_CCW of that mask if bound. The knob switch alone (mask 8) is looked up
+// on release and when turned, before ENC_SW, ENC_SW_CW and ENC_SW_CCW.
+__code uint8_t chord_events[8] = { NONE, KEY1, KEY2, KEY12, KEY3, KEY13, KEY23, NONE };
+__idata uint8_t chord_used = 0;            // keys used by a knob chord, not sent on release
+__bit enc_chord = 0;                       // knob switch used by a chord, no click on release
+
+// Check if chord action i (0 press, 1 clockwise, 2 counter-clockwise) is bound for mask
+uint8_t chord_bound(uint8_t mask, uint8_t i) {
+  if (!((chord_layers >> layer) & 1)) { return 0; }
+  return ch_table[((layer * CH_MASKS + mask) * 3 + i) * 2 + 1] != 0;
+}
+
+// Send chord event of mask
+void chord_send(uint8_t mask, enum Event ev) {
+  if (seq_layer) { run_sequence(1); }       // chord_mask is used by sequence steps
+  chord_mask = mask;
+  parse_type(ev);
+}
+
+// Send chord of the switches in mask, pressed at time since
+void parse_chord(uint8_t mask, uint16_t since) {
+  enum Event ev;
+  if (chord_bound(mask, 0)) {
+    if (mask & DEB_ENC_SW) { enc_chord = 1; }
+    chord_send(mask, CHORD);
+    return;
+  }
+  ev = chord_events[mask & 7];              // knob switch not bound: keys alone
+  if ((ev >= KEY1) && (ev <= KEY3)) { parse_key(ev - KEY1, since); }
+  else if (ev != NONE) { parse_type(ev); }
 }
 
 void enter_bootloader(void);
-void parse_keys() {
-  static __bit key1 = 0;
-  static __bit key2 = 0;
-  static __bit key3 = 0;
 
+// Handle keys as of time now: at a queued switch event (state from before it) or
+// at the current time
+void parse_keys(uint16_t now) {
   static __idata uint8_t press = 0;
   static __idata uint8_t hold = 0;
-  static __idata uint8_t all = 0;  // three keys held
-
-  if (!PIN_read(PIN_KEY1) != key1) { key1 = !key1; }
-  if (!PIN_read(PIN_KEY2) != key2) { key2 = !key2; }
-  if (!PIN_read(PIN_KEY3) != key3) { key3 = !key3; }
-
-  hold = 0;
-  if (key1) { hold |= 1; press |= 1; set_neo_fg(1); }
-  if (key2) { hold |= 2; press |= 2; set_neo_fg(2); }
-  if (key3) { hold |= 4; press |= 4; set_neo_fg(3); }
-
-  if (hold == 0) {
-    switch (press) {
-      case 1: parse_type(KEY1); break;
-      case 2: parse_type(KEY2); break;
-      case 4: parse_type(KEY3); break;
-      case 3: parse_type(KEY12); break;
-      case 5: parse_type(KEY13); break;
-      case 6: parse_type(KEY23); break;
-    }
+  static __bit all = 0;            // three keys held
+  static __idata uint16_t all_since; // time all three went down
+  static __idata uint8_t sent = 0; // keys sent on press, still held
+  static __idata uint16_t first = 0; // time the first key went down
+
+  hold = EVT_state & (DEB_KEY1 | DEB_KEY2 | DEB_KEY3);
+  if (th_state) { hold &= ~taphold_update(hold, now); }  // key owned by tap/hold engine
+  if (chord_used) { sent |= chord_used; press &= ~chord_used; chord_used = 0; }
+  sent &= hold;
+  if ((hold & ~sent) && !press) { first = now; }
+  press |= hold & ~sent;
+  if (hold & DEB_KEY1) { set_neo_fg(1); }
+  if (hold & DEB_KEY2) { set_neo_fg(2); }
+  if (hold & DEB_KEY3) { set_neo_fg(3); }
+
+  // Single key holding a layer: switch when it goes down, also with combos
+  if (((press == 1) || (press == 2) || (press == 4)) && !th_state && !taphold_bound(press >> 1)
+      && layer_hold_bound(KEY1 + (press >> 1))) {
+    parse_type(KEY1 + (press >> 1));
+    sent |= press;
+    press = 0;
+  }
+
+  // Single tap/hold key held for the chord window: the engine decides from now on,
+  // also on layers with combos
+  if (((press == 1) || (press == 2) || (press == 4)) && !th_state && taphold_bound(press >> 1)
+      && ((uint16_t)(now - first) >= KEY_CHORD_ms)) {
+    parse_key(press >> 1, first);
+    sent |= press;
     press = 0;
-    all = 0;
-  } else {
-      if (hold == 7) { all++; if (all > 200) { enter_bootloader(); } }
   }
+
+  #if KEY_EAGER
+  // Single key held for the chord window: send it now, unless this layer
+  // has combos, which need to see all keys of a chord before release.
+  if (press && ((uint16_t)(now - first) >= KEY_CHORD_ms) && !has_combos(layer)) {
+    parse_chord(press, first);
+    sent |= press;                // unbound chords are dropped, as on release
+    press = 0;
+  }
+  #endif
+
+  if ((hold & ~sent) == 0) {
+    if (press) { parse_chord(press | (EVT_state & DEB_ENC_SW), first); }
+    press = 0;
+  }
+  hold = EVT_state & (DEB_KEY1 | DEB_KEY2 | DEB_KEY3);
+  if (hold == 7) {
+    if (!all) { all = 1; all_since = now; }
+    if ((uint16_t)(now - all_since) >= BOOT_HOLD_ms) { enter_bootloader(); }
+  }
+  else { all = 0; }
 }
 
-void parse_encoder() {
+// Handle knob switch and detents turned since the last call, the last one at turned
+void parse_encoder(int8_t steps, uint16_t turned) {
   static __bit keyenc = 0;
-  static __idata uint8_t knob = 0; // knob held down
+  static __idata uint16_t knob;    // time the knob switch went down
   static __bit mode_changed = 0;
+  static __idata int8_t pending = 0; // steps not sent yet
 
-  __idata int8_t encoder_dir = 0;
+  __idata int16_t total;
+  uint8_t keys = EVT_state & (DEB_KEY1 | DEB_KEY2 | DEB_KEY3);
+  uint8_t mask;
 
-  if (!PIN_read(PIN_ENC_SW) != keyenc) {
+  if (!!(EVT_state & DEB_ENC_SW) != keyenc) {
     keyenc = !keyenc;
-    if (keyenc) { mode_changed = 0; }
-    if (!keyenc && !mode_changed) { parse_type(ENC_SW); }
+    if (keyenc) { mode_changed = 0; knob = EVT_time; }
+    if (keyenc && layer_hold_bound(ENC_SW)) {  // layer while held: not on release
+      parse_type(ENC_SW); mode_changed = 1;
+    }
+    if (!keyenc && !mode_changed && !enc_chord) {  // knob switch alone: chord of mask 8
+      if (chord_bound(DEB_ENC_SW, 0)) { chord_send(DEB_ENC_SW, CHORD); }
+      else { parse_type(ENC_SW); }
+    }
+    if (!keyenc) { enc_chord = 0; }
   }
 
-  if (encoder_value >= 4)  { encoder_dir = -1; encoder_value -= 4; }
-  if (encoder_value <= -4) { encoder_dir =  1; encoder_value += 4; }
+  if (steps && (keys || keyenc)) {          // knob turned while switches are held
+    mask = keys | (keyenc ? DEB_ENC_SW : 0);
+    if (chord_bound(mask, 1) || chord_bound(mask, 2)) {
+      chord_used |= keys;
+      if (keyenc) { mode_changed = 1; }
+      for (; steps > 0; steps--) { chord_send(mask, CHORD_CW); }
+      for (; steps < 0; steps++) { chord_send(mask, CHORD_CCW); }
+      pending = 0;
+    }
+  }
 
   if (keyenc) { // encoder pressed
-    if (encoder_dir) {
-      mode_changed = 1;
-      if (encoder_dir > 0) { parse_type(ENC_SW_CCW); }
-      if (encoder_dir < 0) { parse_type(ENC_SW_CW); }
-    }
+    if (steps) { mode_changed = 1; }
+    pending = 0;
+    for (; steps > 0; steps--) { parse_type(ENC_SW_CW); }
+    for (; steps < 0; steps++) { parse_type(ENC_SW_CCW); }
     if (max_layer > 0) {
-      if (knob > 200) { parse_layer(0); mode_changed = 1; }
-      if (mode_changed) { show_mode = 60; knob = 0; } else { knob++; }
+      if (!mode_changed && ((uint16_t)(TMR_millis() - knob) >= KNOB_HOLD_ms)) {
+        parse_layer(0); mode_changed = 1;
+      }
+      if (mode_changed) { show_mode = 60; }
     }
   } else {
-    if (encoder_dir > 0) { parse_type(ENC_CCW); }
-    if (encoder_dir < 0) { parse_type(ENC_CW); }
-    knob = 0;
+    // Steps pile up while reports are waiting for the host. Only the newest
+    // ENC_MAX_PENDING are kept, and a change of direction drops the rest, so
+    // the output stops soon after the knob stops.
+    steps = ENC_accel(steps, option[layer] >> OPT_ACCEL, turned);
+    if (((steps > 0) && (pending < 0)) || ((steps < 0) && (pending > 0))) { pending = 0; }
+    total = pending + steps;
+    if (total > ENC_MAX_PENDING) { total = ENC_MAX_PENDING; }
+    if (total < -ENC_MAX_PENDING) { total = -ENC_MAX_PENDING; }
+    pending = total;
+    if (pending && HID_ready()) {
+      if (pending > 0) { pending -= parse_steps(ENC_CW, pending); }
+      else { pending += parse_steps(ENC_CCW, -pending); }
+    }
   }
 }
 
@@ -376,72 +1126,39 @@ void enter_bootloader(void) {
 void main(void) {
   // Variables
   __idata uint8_t i = 0;
-  __idata uint8_t n = 0;
-  __bit warning = 0;
-  __idata uint8_t encoder_state = 0;
-  __idata uint8_t dt = 0;
+  __idata uint8_t e;                        // input event
+  __idata int8_t steps = 0;                 // detents not handled yet
+  __idata uint16_t turned;                  // time of the last of them
+  __bit valid;
   // __idata struct RGB neomode;
 
   NEO_init();
   if (!PIN_read(PIN_KEY1)) { enter_bootloader(); }
 
-  CLK_config(); DLY_ms(5); KBD_init(); WDT_start();
+  CLK_config(); DLY_ms(5);
 
-  for (i = 0; i <= 3; i++) {
-    n = i * 32;
-    chars[i].mod1 = (char)eeprom_read_byte(n++);
-    chars[i].char1 = (char)eeprom_read_byte(n++);
-    chars[i].mod2 = (char)eeprom_read_byte(n++);
-    chars[i].char2 = (char)eeprom_read_byte(n++);
-
-    chars[i].mod3 = (char)eeprom_read_byte(n++);
-    chars[i].char3 = (char)eeprom_read_byte(n++);
-    chars[i].modSW = (char)eeprom_read_byte(n++);
-    chars[i].charSW = (char)eeprom_read_byte(n++);
-
-    chars[i].modCW = (char)eeprom_read_byte(n++);
-    chars[i].charCW = (char)eeprom_read_byte(n++);
-    chars[i].modCCW = (char)eeprom_read_byte(n++);
-    chars[i].charCCW = (char)eeprom_read_byte(n++);
-
-    neofg[i].r = eeprom_read_byte(n++);
-    neofg[i].g = eeprom_read_byte(n++);
-    neofg[i].b = eeprom_read_byte(n++);
-    option[i] = eeprom_read_byte(n++);
-
-    chars[i].mod12 = (char)eeprom_read_byte(n++);
-    chars[i].char12 = (char)eeprom_read_byte(n++);
-    chars[i].mod23 = (char)eeprom_read_byte(n++);
-    chars[i].char23 = (char)eeprom_read_byte(n++);
-
-    chars[i].mod13 = (char)eeprom_read_byte(n++);
-    chars[i].char13 = (char)eeprom_read_byte(n++);
-    chars[i].swcharCW = (char)eeprom_read_byte(n++);
-    chars[i].swcharCCW = (char)eeprom_read_byte(n++);
-
-    neofade[i].r = eeprom_read_byte(n++);
-    neofade[i].g = eeprom_read_byte(n++);
-    neofade[i].b = eeprom_read_byte(n++);
-    chars[i].swmodCW = (char)eeprom_read_byte(n++);
-
-    neobg[i].r = eeprom_read_byte(n++);
-    neobg[i].g = eeprom_read_byte(n++);
-    neobg[i].b = eeprom_read_byte(n++);
-    chars[i].swmodCCW = (char)eeprom_read_byte(n++);
-
-    if ((neofg[i].r | neofg[i].g | neofg[i].b) == 0) {
-      neofg[i].r = 0xFF; neofg[i].g = 0x16;
-    }
-    if ((neobg[i].r | neobg[i].g | neobg[i].b) == 0) {
-      neobg[i].r = 0xC; neobg[i].g = 0x1;
-    }
-    if (neofade[i].r == 0) { neofade[i].r = 1; }
-    if (neofade[i].g == 0) { neofade[i].g = 1; }
-    if (neofade[i].b == 0) { neofade[i].b = 1; }
+#ifdef KEYMAP_BAKED
+  valid = 1;
+  load_baked();
+  check_colors();
+  max_layer = option[0] & OPT_LAYERS;
+#else
+  valid = load_config();
+  load_kmap();
+  check_colors();
+  max_layer = option[0] & OPT_LAYERS;
+  if (cfg_saved && (config[CFG_STATE] & CFG_STATE_SAVED)) {  // restore saved state
+    max_layer = (config[CFG_STATE] >> 2) & 3;
+    layer_to(config[CFG_STATE] & 3);
   }
-  max_layer = option[0];
+  saved_state = get_state();
+  reset_stage();
+#endif
+  HID_interval = poll_interval[(option[0] >> OPT_POLL) & 7];
+
+  KBD_init(); ENC_init(); DEB_init(); EVT_init(); TMR_init(); WDT_start();
 
-  if ((chars[0].char1 | chars[0].char2 | chars[0].char3) == 0) {
+  if (!valid) {
     neo[1].r = 255; neo[1].g = 0; neo[1].b = 0; NEO_update();
     DLY_ms(200); neo[1].r = 0; NEO_update();
     DLY_ms(200); neo[1].r = 255; NEO_update();
@@ -457,25 +1174,53 @@ void main(void) {
   set_neo_fg(1); set_neo_fg(2); set_neo_fg(3);
 
   while (1) {
-    if (max_layer == 0) { layer = 0; }
-    i = (encoder_state & 3) | ((!PIN_read(PIN_ENC_A)) << 2) | ((!PIN_read(PIN_ENC_B)) << 3);
-    encoder_state = i >> 2;
-    encoder_value += encoder_factor[i];
-    dt++;
-
-    if (dt >= 5) {
-      parse_keys();
-      parse_encoder();
+    TMR_wait();                             // idle until next tick
+
+    // Inputs queued by the timer interrupt, in the order they happened
+    while ((e = EVT_peek())) {
+      if (EVT_type(e) == EVT_CW) { if (steps < 127) { steps++; } }
+      else if (EVT_type(e) == EVT_CCW) { if (steps > -127) { steps--; } }
+      else {
+        if (steps) { parse_encoder(steps, turned); steps = 0; }  // turned before the switch
+        parse_keys(EVT_time);               // timeouts up to the switch event
+      }
+      EVT_read();
+      if (EVT_type(e) >= EVT_CW) { turned = EVT_time; }
+      else {
+        parse_keys(EVT_time);
+        parse_encoder(0, 0);
+        if (layer_held) { layer_release(EVT_state); }
+      }
+    }
+    if (steps) { parse_encoder(steps, turned); steps = 0; }
+
+    if (TMR_due(TMR_SCAN, SCAN_PERIOD_ms)) {  // timeouts without events
+      parse_keys(TMR_millis());
+      parse_encoder(0, 0);
+    }
+
+    if (seq_layer) { run_sequence(0); }    // delayed steps of a sequence
+    KBD_update();                           // protocol changed by host
+    MAC_update();                           // one macro instruction per tick
+
+    if (TMR_due(TMR_LED, LED_PERIOD_ms)) {
       NEO_update();
       fade_out(0);
       if (show_mode) {
         show_mode--;
         set_neo_rgb(0, neofg[layer].r, neofg[layer].g, neofg[layer].b);
       }
-      WDT_reset();
-      dt -= 5;
     }
 
-    DLY_ms(1);
+#ifndef KEYMAP_BAKED
+    if (cfg_request) { update_config(); }  // keymap from host
+
+    if (TMR_due(TMR_FLASH, FLASH_PERIOD_ms)) {
+      save_state();
+      DFL_update();                         // write at most one byte
+    }
+#endif
+
+    if (TMR_due(TMR_WDT, WDT_PERIOD_ms)) { WDT_reset(); }
   }
 }
@@ -0,0 +1,34 @@
+// ===================================================================================
+// Code Flash Keymap Region for CH551, CH552 and CH554
+// ===================================================================================
+
+#include "ch554.h"
+#include "codeflash.h"
+
+// ===================================================================================
+// Write Words to Region
+// ===================================================================================
+uint8_t CFL_write(uint16_t addr, __xdata uint8_t* buf, uint8_t len) {
+  uint8_t ok = 1;
+  if((addr & 1) || (len & 1) || (addr + len > CFL_SIZE)) return 0;
+  for(; len; len -= 2, addr += 2, buf += 2) {
+    if((CFL_data[addr] == buf[0]) && (CFL_data[addr + 1] == buf[1])) continue;
+    EA = 0;                                 // safe mode must not be interrupted
+    SAFE_MOD = 0x55;                        // enter safe mode
+    SAFE_MOD = 0xAA;
+    GLOBAL_CFG |= bCODE_WE;                 // enable code flash write
+    SAFE_MOD = 0;                           // leave safe mode
+    ROM_ADDR_H = (CFL_ADDR + addr) >> 8;
+    ROM_ADDR_L = (CFL_ADDR + addr) & 0xFF;
+    ROM_DATA_L = buf[0];
+    ROM_DATA_H = buf[1];
+    if(ROM_STATUS & bROM_ADDR_OK) ROM_CTRL = ROM_CMD_WRITE;  // write word
+    SAFE_MOD = 0x55;                        // enter safe mode
+    SAFE_MOD = 0xAA;
+    GLOBAL_CFG &= ~bCODE_WE;                // write protect code flash
+    SAFE_MOD = 0;                           // leave safe mode
+    EA = 1;
+    if((CFL_data[addr] != buf[0]) || (CFL_data[addr + 1] != buf[1])) ok = 0;  // verify
+  }
+  return ok;
+}
@@ -0,0 +1,23 @@
+// ===================================================================================
+// Code Flash Keymap Region for CH551, CH552 and CH554
+// ===================================================================================
+//
+// The code flash between the end of the firmware (CODE_SIZE in the Makefile) and
+// the bootloader holds a keymap region of CFL_SIZE bytes. It is read like any
+// other __code data (movc) and written by IAP in 16-bit words. Words that already
+// hold the right value are not written. Every written word is read back.
+//
+// Functions available:
+// --------------------
+// CFL_write(addr, buf, len)  write len bytes (even) from buf at region offset addr (even)
+// CFL_data                   the region as __code array
+
+#pragma once
+#include <stdint.h>
+
+#define CFL_ADDR        0x3000      // start of region, must match CODE_SIZE
+#define CFL_SIZE        0x0800      // up to the bootloader at 0x3800
+
+#define CFL_data        ((__code uint8_t*)CFL_ADDR)
+
+uint8_t CFL_write(uint16_t addr, __xdata uint8_t* buf, uint8_t len);  // 0 if failed
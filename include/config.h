@@ -16,6 +16,25 @@
 // NeoPixel configuration
 #define NEO_GRB                         // type of pixel: NEO_GRB or NEO_RGB
 
+// Task periods (in ms, 1..127)
+#define DEB_SAMPLE_ms       1           // switch sampling, switches settle after 4 samples
+#define SCAN_PERIOD_ms      5           // key and encoder timeouts (inputs are queued every ms)
+#define LED_PERIOD_ms       5           // NeoPixel refresh and fading
+#define WDT_PERIOD_ms       100         // watchdog feeding
+#define FLASH_PERIOD_ms     10          // data flash writing, one byte per period
+#define STATE_SAVE_ms       3000        // layer changes are saved after this time
+
+// Key emission
+#define KEY_EAGER           0           // 1: send keys on press, on layers without combos
+#define KEY_CHORD_ms        30          // chord window, a key is sent after this time alone
+#define TAP_HOLD_ms         200         // tap/hold keys: default hold threshold
+#define TAP_DOUBLE_ms       200         // tap/hold keys: default double tap window
+#define BOOT_HOLD_ms        1000        // hold all three keys to enter the bootloader
+#define KNOB_HOLD_ms        1000        // hold the knob switch to return to layer 0
+
+// Encoder output
+#define ENC_MAX_PENDING     8           // max encoder steps waiting to be sent (1..127)
+
 // USB device descriptor
 #define USB_VENDOR_ID       0x1189      // VID
 #define USB_PRODUCT_ID      0x8890      // PID
@@ -24,6 +43,9 @@
 // USB configuration descriptor
 #define USB_MAX_POWER_mA    50          // max power in mA
 
+// USB keyboard report
+#define KBD_NKRO            1           // 1: N-key rollover (boot protocol still uses 6 keys)
+
 // USB descriptor strings
 #define MANUFACTURER_STR    'w','a','g','i','m','i','n','a','t','o','r'
 #define PRODUCT_STR         'M','a','c','r','o','P','a','d'
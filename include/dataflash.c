@@ -0,0 +1,124 @@
+// ===================================================================================
+// Data Flash Functions for CH551, CH552 and CH554
+// ===================================================================================
+
+#include "ch554.h"
+#include "dataflash.h"
+
+// ===================================================================================
+// Variables
+// ===================================================================================
+__xdata uint8_t* DFL_buf;                   // buffer of pending commit
+__idata uint8_t DFL_next = 0;               // next address to compare
+__idata uint8_t DFL_end = 0;                // end of pending commit, 0 if idle
+__idata uint16_t DFL_written = 0;           // bytes written since start (wear)
+
+// ===================================================================================
+// Read Data Flash
+// ===================================================================================
+// Copy all data flash bytes to buf. The data flash sits at even addresses only,
+// each byte is fetched by the flash read command.
+// (see https://github.com/DeqingSun/ch55xduino/blob/ch55xduino/ch55xduino/ch55x/cores/ch55xduino/eeprom.c)
+#pragma callee_saves DFL_read
+void DFL_read(__xdata uint8_t* buf) {
+  buf;                          // stop unreferenced argument warning
+  __asm
+    push ar6                    ; r6 -> stack
+    push ar7                    ; r7 -> stack
+    mov  _ROM_ADDR_H, #(DATA_FLASH_ADDR >> 8)
+    mov  r6, #0                 ; r6 <- flash address
+    mov  r7, #DFL_SIZE          ; r7 <- number of bytes
+    01$:
+    mov  _ROM_ADDR_L, r6        ; set flash address
+    mov  _ROM_CTRL, #ROM_CMD_READ
+    mov  a, _ROM_DATA_L         ; acc <- data flash byte
+    movx @dptr, a               ; acc -> buf[dptr]
+    inc  dptr                   ; inc dptr
+    inc  r6                     ; next even address
+    inc  r6
+    djnz r7, 01$                ; repeat DFL_SIZE times
+    pop  ar7                    ; r7 <- stack
+    pop  ar6                    ; r6 <- stack
+  __endasm;
+}
+
+// ===================================================================================
+// Write Data Flash Byte
+// ===================================================================================
+void DFL_write(uint8_t addr, uint8_t data) {
+  EA = 0;                                   // safe mode must not be interrupted
+  SAFE_MOD = 0x55;                          // enter safe mode
+  SAFE_MOD = 0xAA;
+  GLOBAL_CFG |= bDATA_WE;                   // enable data flash write
+  SAFE_MOD = 0;                             // leave safe mode
+  ROM_ADDR_H = DATA_FLASH_ADDR >> 8;
+  ROM_ADDR_L = addr << 1;                   // data flash sits at even addresses
+  ROM_DATA_L = data;
+  if(ROM_STATUS & bROM_ADDR_OK) ROM_CTRL = ROM_CMD_WRITE;  // write byte
+  SAFE_MOD = 0x55;                          // enter safe mode
+  SAFE_MOD = 0xAA;
+  GLOBAL_CFG &= ~bDATA_WE;                  // write protect data flash
+  SAFE_MOD = 0;                             // leave safe mode
+  EA = 1;
+  DFL_written++;
+}
+
+// ===================================================================================
+// Read Data Flash Byte
+// ===================================================================================
+uint8_t DFL_readByte(uint8_t addr) {
+  ROM_ADDR_H = DATA_FLASH_ADDR >> 8;
+  ROM_ADDR_L = addr << 1;                   // data flash sits at even addresses
+  ROM_CTRL   = ROM_CMD_READ;
+  return ROM_DATA_L;
+}
+
+// ===================================================================================
+// Start Commit
+// ===================================================================================
+void DFL_commit(__xdata uint8_t* buf, uint8_t addr, uint8_t len) {
+  DFL_buf = buf;
+  if(DFL_end) {                             // commit pending: merge ranges
+    if(addr < DFL_next) DFL_next = addr;
+    if(addr + len > DFL_end) DFL_end = addr + len;
+  }
+  else {
+    DFL_next = addr;
+    DFL_end  = addr + len;
+  }
+}
+
+// ===================================================================================
+// Continue Commit
+// ===================================================================================
+// Writes at most one byte, so the caller is never stalled for more than one write.
+uint8_t DFL_update(void) {
+  uint8_t data;
+  while(DFL_next < DFL_end) {
+    data = DFL_buf[DFL_next];
+    if(DFL_readByte(DFL_next) != data) {    // changed?
+      DFL_write(DFL_next++, data);
+      return 1;
+    }
+    DFL_next++;                             // unchanged: skip
+  }
+  DFL_end = 0;                              // commit done
+  return 0;
+}
+
+// ===================================================================================
+// Get CRC-16 (CCITT)
+// ===================================================================================
+// buf is a generic pointer, so the code flash keymap is checked the same way.
+uint16_t DFL_crc(uint8_t* buf, uint16_t len) {
+  uint16_t crc = 0xFFFF;
+  uint8_t i;
+  while(len--) {
+    crc ^= (uint16_t)(*buf++) << 8;
+    for(i=8; i; i--) {
+      if(crc & 0x8000) crc = (crc << 1) ^ 0x1021;
+      else crc <<= 1;
+    }
+  }
+  return crc;
+}
@@ -0,0 +1,39 @@
+// ===================================================================================
+// Data Flash Functions for CH551, CH552 and CH554
+// ===================================================================================
+//
+// The 128 bytes of data flash are read in one pass into a buffer in XRAM, instead
+// of setting up a flash read for each byte from C. A CRC-16 (CCITT, initial value
+// 0xFFFF) is used to tell a complete configuration from a blank or half-written one.
+//
+// Writing a byte stalls the CPU, so a commit only marks a range of the buffer as
+// pending. DFL_update() then writes one changed byte per call from the main loop,
+// bytes already holding the right value are skipped and never wear the flash.
+// Commits made while another one is pending are merged into it.
+//
+// Functions available:
+// --------------------
+// DFL_read(buf)            copy all DFL_SIZE bytes of data flash to buf
+// DFL_readByte(addr)       read one byte of data flash
+// DFL_write(addr, data)    write one byte to data flash right away
+// DFL_commit(buf, addr, len)  write len bytes of buf from addr on in the background
+// DFL_update()             write next changed byte of pending commit, 1 while busy
+// DFL_busy()               1 while a commit is pending
+// DFL_crc(buf, len)        get CRC-16 of len bytes in buf (any memory)
+
+#pragma once
+#include <stdint.h>
+
+#define DFL_SIZE        128         // bytes of data flash
+
+extern __idata uint8_t DFL_end;                               // end of pending commit
+extern __idata uint16_t DFL_written;                          // bytes written since start
+
+void DFL_read(__xdata uint8_t* buf);                          // read data flash
+uint8_t DFL_readByte(uint8_t addr);                           // read data flash byte
+void DFL_write(uint8_t addr, uint8_t data);                   // write data flash byte
+void DFL_commit(__xdata uint8_t* buf, uint8_t addr, uint8_t len);  // start commit
+uint8_t DFL_update(void);                                     // continue commit
+uint16_t DFL_crc(uint8_t* buf, uint16_t len);                 // get CRC-16
+
+#define DFL_busy()  (DFL_end != 0)                            // commit pending
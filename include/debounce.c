@@ -0,0 +1,62 @@
+// ===================================================================================
+// Switch Debouncer for CH551, CH552 and CH554
+// ===================================================================================
+
+#include "debounce.h"
+
+// Get bit of PIN from port snapshots p1 and p3
+#define DEB_bit(PIN, p1, p3)  ((((PIN) < P30 ? (p1) : (p3)) >> ((PIN) & 7)) & 1)
+
+// ===================================================================================
+// Variables
+// ===================================================================================
+__idata uint8_t DEB_state;                  // debounced state, 1 = pressed
+__idata uint8_t DEB_chatter[DEB_COUNT];     // rejected changes per switch
+__idata uint8_t DEB_cnt0, DEB_cnt1;         // vertical counter bits
+__xdata uint8_t DEB_wait;                   // ticks until the next sample
+
+// ===================================================================================
+// Reset Debouncer
+// ===================================================================================
+void DEB_init(void) {
+  uint8_t i;
+  DEB_state = 0;
+  DEB_cnt0  = 0xFF;                         // counters count down from 3
+  DEB_cnt1  = 0xFF;
+  DEB_wait  = 1;
+  for(i=0; i<DEB_COUNT; i++) DEB_chatter[i] = 0;
+}
+
+// ===================================================================================
+// Take a Sample of All Switches (called from timer2 interrupt)
+// ===================================================================================
+#pragma save
+#pragma nooverlay
+void DEB_update(void) {
+  uint8_t p1, p3, raw, delta, bounced, i;
+
+  if(--DEB_wait) return;                    // sample every DEB_SAMPLE_ms ticks
+  DEB_wait = DEB_SAMPLE_ms;
+
+  p1 = P1;                                  // one snapshot of both ports
+  p3 = P3;
+  raw = ~( DEB_bit(PIN_KEY1,   p1, p3)
+         | DEB_bit(PIN_KEY2,   p1, p3) << 1
+         | DEB_bit(PIN_KEY3,   p1, p3) << 2
+         | DEB_bit(PIN_ENC_SW, p1, p3) << 3 ) & 0x0F;
+
+  delta    = raw ^ DEB_state;               // switches differing from state
+  bounced  = ~(DEB_cnt0 & DEB_cnt1) & ~delta & 0x0F;  // counting, but reverted
+  DEB_cnt0 = ~(DEB_cnt0 & delta);           // count down or reset to 3
+  DEB_cnt1 = DEB_cnt0 ^ (DEB_cnt1 & delta);
+  delta   &= DEB_cnt0 & DEB_cnt1;           // counter rolled over: accept
+  DEB_state ^= delta;
+
+  if(bounced) {
+    for(i=0; i<DEB_COUNT; i++) {
+      if((bounced & 1) && (DEB_chatter[i] < 255)) DEB_chatter[i]++;
+      bounced >>= 1;
+    }
+  }
+}
+#pragma restore
@@ -0,0 +1,32 @@
+// ===================================================================================
+// Switch Debouncer for CH551, CH552 and CH554
+// ===================================================================================
+//
+// Debounces all switches at once with a vertical counter: bit n of two counter
+// bytes forms a 2-bit counter for switch n. P1 and P3 are read once per sample,
+// a switch changes its debounced state after 4 equal samples in a row.
+// Changes that revert before that are counted as chatter for each switch.
+// DEB_update() is called every tick from the timer interrupt by EVT_update() and
+// samples every DEB_SAMPLE_ms ticks.
+//
+// The following must be defined in config.h:
+// PIN_KEY1, PIN_KEY2, PIN_KEY3, PIN_ENC_SW - switch pins (active low)
+// DEB_SAMPLE_ms                            - sample period in ms
+
+#pragma once
+#include <stdint.h>
+#include "gpio.h"
+#include "config.h"
+
+// Switch bits in DEB_state
+#define DEB_KEY1        0x01
+#define DEB_KEY2        0x02
+#define DEB_KEY3        0x04
+#define DEB_ENC_SW      0x08
+#define DEB_COUNT       4           // number of switches
+
+extern __idata uint8_t DEB_state;               // debounced state, 1 = pressed
+extern __idata uint8_t DEB_chatter[DEB_COUNT];  // rejected changes per switch
+
+void DEB_init(void);        // reset debouncer
+void DEB_update(void);      // take a sample of all switches (interrupt context)
@@ -0,0 +1,83 @@
+// ===================================================================================
+// Rotary Encoder Functions for CH551, CH552 and CH554
+// ===================================================================================
+
+#include "encoder.h"
+
+// ===================================================================================
+// Variables and Constants
+// ===================================================================================
+
+// Count change indexed by (current AB << 2 | previous AB)
+__code int8_t ENC_factor[16] = { 0, 1, -1, 2, -1, 0, -2, 1, 1, -2, 0, -1, 2, -1, 1, 0 };
+
+// Step multipliers of the acceleration curves, from slow to fast turning
+__code uint8_t ENC_curve[ENC_CURVES][4] = {
+  { 1, 1, 1, 1 },                           // 0: off
+  { 1, 1, 2, 3 },                           // 1: mild
+  { 1, 2, 3, 5 },                           // 2: medium
+  { 1, 2, 4, 8 }                            // 3: strong
+};
+
+__idata uint8_t ENC_state = 0;              // previous pin state (A | B << 1)
+__idata int8_t  ENC_count = 0;              // counts within current detent
+volatile __idata int8_t ENC_steps = 0;      // accumulated detents
+__idata uint16_t ENC_last = 0;              // time of last accelerated detent
+
+// ===================================================================================
+// Sync Decoder with Current Encoder Position
+// ===================================================================================
+void ENC_init(void) {
+  ENC_state = (!PIN_read(PIN_ENC_A)) | ((!PIN_read(PIN_ENC_B)) << 1);
+  ENC_count = 0;
+  ENC_steps = 0;
+}
+
+// ===================================================================================
+// Sample Encoder Pins (called from timer2 interrupt)
+// ===================================================================================
+#pragma save
+#pragma nooverlay
+void ENC_update(void) {
+  uint8_t i = ENC_state | ((!PIN_read(PIN_ENC_A)) << 2) | ((!PIN_read(PIN_ENC_B)) << 3);
+  ENC_state = i >> 2;
+  ENC_count += ENC_factor[i];
+  if(ENC_count >= 4) {
+    ENC_count -= 4;
+    if(ENC_steps < 127) ENC_steps++;
+  }
+  else if(ENC_count <= -4) {
+    ENC_count += 4;
+    if(ENC_steps > -127) ENC_steps--;
+  }
+}
+#pragma restore
+
+// ===================================================================================
+// Apply Acceleration Curve to Steps
+// ===================================================================================
+// The turning speed is the time between the last detent of the previous call and
+// the last detent now (time, the tick it was queued at), divided by the number
+// of detents.
+int8_t ENC_accel(int8_t steps, uint8_t curve, uint16_t time) {
+  uint16_t interval;
+  uint8_t  count, speed;
+  int16_t  result;
+
+  if(!steps) return 0;
+  interval = time - ENC_last;
+  ENC_last = time;
+  if(curve >= ENC_CURVES) curve = ENC_CURVES - 1;
+
+  count = steps < 0 ? -steps : steps;
+  interval /= count;
+  if(interval >= ENC_SLOW_ms)        speed = 0;
+  else if(interval >= ENC_MEDIUM_ms) speed = 1;
+  else if(interval >= ENC_FAST_ms)   speed = 2;
+  else                               speed = 3;
+
+  result = (int16_t)steps * ENC_curve[curve][speed];
+  if(result > 127)  return 127;
+  if(result < -127) return -127;
+  return result;
+}
@@ -0,0 +1,33 @@
+// ===================================================================================
+// Rotary Encoder Functions for CH551, CH552 and CH554
+// ===================================================================================
+//
+// Quadrature decoder for a mechanical rotary encoder with 4 counts per detent.
+// ENC_update() is called from the timer2 interrupt at several kHz, so no steps
+// are lost while the main loop is busy. Detents are accumulated in ENC_steps until
+// they are queued as events by EVT_update(), see events.h. ENC_accel() multiplies
+// them according to the turning speed, using one of the ENC_CURVES acceleration
+// curves. It takes the tick of the last detent from the event queue, so detents
+// handled late are not mistaken for a fast spin.
+//
+// The following must be defined in config.h:
+// PIN_ENC_A - pin connected to encoder output A
+// PIN_ENC_B - pin connected to encoder output B
+
+#pragma once
+#include <stdint.h>
+#include "gpio.h"
+#include "config.h"
+
+// Acceleration: time per detent (in ms) above which the multiplier of the
+// respective curve column applies, from slow to fast turning
+#define ENC_SLOW_ms     60          // slower than this is always 1:1
+#define ENC_MEDIUM_ms   30
+#define ENC_FAST_ms     15
+#define ENC_CURVES      4           // number of acceleration curves (0 = off)
+
+extern volatile __idata int8_t ENC_steps;   // detents not queued yet (interrupt context)
+
+void ENC_init(void);        // sync decoder with current encoder position
+void ENC_update(void);      // sample encoder pins (interrupt context)
+int8_t ENC_accel(int8_t steps, uint8_t curve, uint16_t time);  // apply acceleration curve
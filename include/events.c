@@ -0,0 +1,88 @@
+// ===================================================================================
+// Input Event Queue for CH551, CH552 and CH554
+// ===================================================================================
+
+#include "events.h"
+#include "debounce.h"
+#include "encoder.h"
+#include "timer.h"
+
+// ===================================================================================
+// Variables
+// ===================================================================================
+__xdata uint8_t  EVT_code[EVT_SIZE];        // event codes
+__xdata uint16_t EVT_tick[EVT_SIZE];        // time of events
+volatile __idata uint8_t EVT_head = 0;      // next slot to write (interrupt)
+volatile __idata uint8_t EVT_tail = 0;      // next slot to read (main loop)
+__idata uint8_t EVT_sent;                   // switch state as queued
+__idata uint8_t EVT_state;                  // switch state as read
+__idata uint16_t EVT_time;                  // time of event read
+volatile __idata uint16_t EVT_overflow = 0; // ticks with the queue full
+
+// ===================================================================================
+// Empty Queue
+// ===================================================================================
+void EVT_init(void) {
+  EVT_head  = 0;
+  EVT_tail  = 0;
+  EVT_sent  = DEB_state;
+  EVT_state = DEB_state;
+}
+
+// ===================================================================================
+// Scan Inputs and Queue Changes (called from timer2 interrupt)
+// ===================================================================================
+#pragma save
+#pragma nooverlay
+void EVT_update(void) {
+  uint8_t i, code, next;
+  uint8_t change;
+
+  DEB_update();                             // sample switches
+  change = DEB_state ^ EVT_sent;
+  for(i=0; i<DEB_COUNT + 1; i++) {
+    if(i < DEB_COUNT) {                     // switches first, in bit order
+      if(!(change & (1 << i))) continue;
+      code = (DEB_state & (1 << i)) ? (EVT_DOWN | i) : (EVT_UP | i);
+    }
+    else {                                  // then one encoder detent per tick
+      if(!ENC_steps) return;
+      code = (ENC_steps > 0) ? EVT_CW : EVT_CCW;
+    }
+    next = (EVT_head + 1) & (EVT_SIZE - 1);
+    if(next == EVT_tail) {                  // full: keep the rest for later
+      if(EVT_overflow < 0xFFFF) EVT_overflow++;
+      return;
+    }
+    EVT_code[EVT_head] = code;
+    EVT_tick[EVT_head] = TMR_ticks;
+    EVT_head = next;
+    if(i < DEB_COUNT) EVT_sent ^= 1 << i;
+    else if(code == EVT_CW) ENC_steps--;
+    else ENC_steps++;
+  }
+}
+#pragma restore
+
+// ===================================================================================
+// Get Next Event Without Taking It
+// ===================================================================================
+// Lets the caller act on timeouts that expired before the event, with the switch
+// state from before it.
+uint8_t EVT_peek(void) {
+  if(EVT_tail == EVT_head) return 0;
+  EVT_time = EVT_tick[EVT_tail];
+  return EVT_code[EVT_tail];
+}
+
+// ===================================================================================
+// Take Next Event
+// ===================================================================================
+uint8_t EVT_read(void) {
+  uint8_t code = EVT_peek();
+  if(!code) return 0;
+  EVT_tail = (EVT_tail + 1) & (EVT_SIZE - 1);   // slot is free again
+  if(EVT_type(code) == EVT_DOWN) EVT_state |= 1 << (code & 0x0F);
+  else if(EVT_type(code) == EVT_UP) EVT_state &= ~(1 << (code & 0x0F));
+  return code;
+}
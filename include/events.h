@@ -0,0 +1,43 @@
+// ===================================================================================
+// Input Event Queue for CH551, CH552 and CH554
+// ===================================================================================
+//
+// Switches and rotary encoder are scanned in the timer interrupt, once per tick.
+// Every change of a debounced switch and every encoder detent is put into a ring
+// buffer in XRAM, together with the tick it happened at. The main loop takes the
+// events out in order, so a busy main loop delays them but never loses them.
+//
+// The interrupt only writes EVT_head and the main loop only writes EVT_tail, so
+// neither side has to block the other. If the buffer is full, changes are kept
+// back (switch state and encoder detents still pending) and queued in a later
+// tick; EVT_overflow counts the ticks this happened.
+//
+// Functions available:
+// --------------------
+// EVT_init()               empty queue, take current switch state as reported
+// EVT_update()             scan inputs and queue changes (interrupt context)
+// EVT_peek()               get next event without taking it, 0 if none; sets EVT_time
+// EVT_read()               take next event, 0 if none; sets EVT_time and EVT_state
+//
+// EVT_update() must be called every tick from the timer interrupt, see timer.h.
+
+#pragma once
+#include <stdint.h>
+
+#define EVT_SIZE        32          // queued events (power of 2)
+
+// Event codes: type | switch number (bit number in DEB_state)
+#define EVT_DOWN        0x10        // switch pressed
+#define EVT_UP          0x20        // switch released
+#define EVT_CW          0x30        // encoder detent clockwise
+#define EVT_CCW         0x40        // encoder detent counter-clockwise
+#define EVT_type(e)     ((e) & 0xF0)
+
+extern __idata uint8_t EVT_state;                   // switches as of the last event read
+extern __idata uint16_t EVT_time;                   // tick of the last event read
+extern volatile __idata uint16_t EVT_overflow;      // ticks with the queue full
+
+void EVT_init(void);                                // empty queue
+void EVT_update(void);                              // scan inputs (interrupt context)
+uint8_t EVT_peek(void);                             // get next event
+uint8_t EVT_read(void);                             // take next event
@@ -0,0 +1,149 @@
+// ===================================================================================
+// Macro Interpreter for CH551, CH552 and CH554
+// ===================================================================================
+
+#include "macro.h"
+#include "timer.h"
+#include "usb_conkbd.h"
+
+#if HID_QUEUE_SIZE - 1 < MAC_ROOM
+  #error Report queue too small for a macro instruction!
+#endif
+
+// ===================================================================================
+// Macro Table
+// ===================================================================================
+__code uint8_t MAC_table[] = {
+  // Macro 0: select all and copy
+  MAC_CHORD, 0x01, 'a', MAC_CHORD, 0x01, 'c', MAC_END,
+
+  // Macro 1: open run dialog and start notepad
+  MAC_CHORD, 0x08, 'r', MAC_DELAY, 30, 'n', 'o', 't', 'e', 'p', 'a', 'd', MAC_TYPE, KBD_KEY_RETURN, MAC_END,
+};
+
+// Instruction lengths including opcode, ASCII characters are one byte
+__code uint8_t MAC_length[MAC_OPCODES] = { 1, 2, 2, 2, 3, 2, 3, 2, 2, 1, 2, 3, 4, 5, 6, 7, 8 };
+
+// ===================================================================================
+// Variables
+// ===================================================================================
+__code uint8_t* __xdata MAC_pc = 0;         // next instruction, 0 if idle
+__code uint8_t* __xdata MAC_base = MAC_table;   // macro table in use
+__code uint8_t* __xdata MAC_end = MAC_table + sizeof(MAC_table);  // end of table
+__xdata uint16_t MAC_since;                 // start of delay
+__xdata uint16_t MAC_delay = 0;             // length of delay in ms
+
+// ===================================================================================
+// Get Instruction Length, 0 if Invalid
+// ===================================================================================
+uint8_t MAC_len(uint8_t op) {
+  if(op < MAC_OPCODES) return MAC_length[op];
+  if(MAC_text(op)) return 1;
+  return 0;
+}
+
+// ===================================================================================
+// Get Instruction at MAC_pc, MAC_END if Invalid or Not Within the Table
+// ===================================================================================
+// Tables from the keymap region come from the host and may lack the final MAC_END.
+uint8_t MAC_fetch(void) {
+  uint8_t op, len;
+  if(MAC_pc >= MAC_end) return MAC_END;
+  op  = *MAC_pc;
+  len = MAC_len(op);
+  if(!len || (MAC_end - MAC_pc < len)) return MAC_END;
+  return op;
+}
+
+// ===================================================================================
+// Select Macro Table
+// ===================================================================================
+void MAC_setTable(__code uint8_t* table, uint16_t len) {
+  if(MAC_pc) MAC_stop();
+  if(!table) {                              // built-in table
+    table = MAC_table;
+    len   = sizeof(MAC_table);
+  }
+  MAC_base = table;
+  MAC_end  = table + len;
+}
+
+// ===================================================================================
+// Start Macro
+// ===================================================================================
+void MAC_start(uint8_t n) {
+  __code uint8_t* pc = MAC_base;
+  uint8_t len;
+
+  if(MAC_pc) MAC_stop();
+  while(n) {                                // skip n macros
+    if(pc >= MAC_end) return;               // no such macro
+    if(*pc == MAC_END) n--;
+    len = MAC_len(*pc);
+    if(!len) return;                        // broken table
+    pc += len;
+  }
+  if(pc < MAC_end) MAC_pc = pc;
+  MAC_delay = 0;
+}
+
+// ===================================================================================
+// Stop Macro
+// ===================================================================================
+void MAC_stop(void) {
+  MAC_pc = 0;
+  KBD_releaseAll();
+}
+
+// ===================================================================================
+// Run Next Instruction
+// ===================================================================================
+uint8_t MAC_update(void) {
+  uint8_t op;
+  if(!MAC_pc) return 0;                     // idle
+  if(MAC_delay) {                           // waiting?
+    if((uint16_t)(TMR_millis() - MAC_since) < MAC_delay) return 1;
+    MAC_delay = 0;
+  }
+  if(HID_free() < MAC_ROOM) return 1;       // wait for room in report queue
+
+  op = MAC_fetch();
+  if(MAC_text(op)) {                        // text: packed while the queue has room
+    do {
+      KBD_stream(op);
+      MAC_pc++;
+      op = MAC_fetch();
+    } while(MAC_text(op) && (HID_free() >= MAC_ROOM));
+    return 1;
+  }
+  if(MAC_report(op)) {                      // reports: copied while the queue has room
+    do {
+      KBD_setKeys(MAC_pc[1], MAC_pc + 2, op - MAC_KEYS);
+      MAC_pc += MAC_len(op);
+      op = MAC_fetch();
+    } while(MAC_report(op) && (HID_free() >= MAC_ROOM));
+    return 1;
+  }
+  KBD_streamEnd();                          // release text before other instructions
+  switch(op) {                              // invalid or past the table: MAC_END
+    case MAC_END:         MAC_pc = 0; return 0;
+    case MAC_PRESS:       KBD_press(MAC_pc[1]); break;
+    case MAC_RELEASE:     KBD_release(MAC_pc[1]); break;
+    case MAC_TYPE:        KBD_type(MAC_pc[1]); break;
+    case MAC_CHORD:       KBD_chord(MAC_pc[2], MAC_pc[1]); break;
+    case MAC_RAW:         KBD_chordRaw(MAC_pc[1], 0); break;
+    case MAC_CONSUMER:    CON_type(MAC_pc[1] | ((uint16_t)MAC_pc[2] << 8)); break;
+    case MAC_DELAY:
+      MAC_since = TMR_millis();
+      MAC_delay = (uint16_t)MAC_pc[1] * MAC_DELAY_ms;
+      break;
+    case MAC_LAYER:
+      #ifdef MAC_LAYER_handler
+      MAC_LAYER_handler(MAC_pc[1]);
+      #endif
+      break;
+    case MAC_RELEASE_ALL: KBD_releaseAll(); break;
+  }
+  MAC_pc += MAC_len(op);
+  return 1;
+}
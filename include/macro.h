@@ -0,0 +1,78 @@
+// ===================================================================================
+// Macro Interpreter for CH551, CH552 and CH554
+// ===================================================================================
+//
+// Macros are byte code in code flash, stored back to back in MAC_table, each one
+// ended by MAC_END (an invalid instruction or the end of the table ends it too).
+// MAC_update() is called on every tick of the main loop and runs one instruction
+// per call, so macros of any length never stall scanning, LEDs or USB. Delays
+// are waited out against the tick timer instead of busy waiting.
+// Bytes 0x20-0x7E type the respective ASCII character, so text is stored as is.
+// Runs of text are typed with KBD_stream() as long as the report queue has room,
+// which needs about one report per character instead of two.
+//
+// Instructions:
+// -------------
+// MAC_END                  end of macro
+// MAC_PRESS, key           press key (ASCII or KBD_KEY_*)
+// MAC_RELEASE, key         release key
+// MAC_TYPE, key            press and release key
+// MAC_CHORD, mod, key      press and release key with modifier bits (like keymap)
+// MAC_RAW, usage           press and release keyboard usage
+// MAC_CONSUMER, lo, hi     press and release 16-bit consumer usage
+// MAC_DELAY, n             wait n * 10 ms
+// MAC_LAYER, n             switch to layer n
+// MAC_RELEASE_ALL          release all keys
+// MAC_KEYS + n, mod, keys  send report with modifier bits and n keyboard usages (0-6)
+//
+// Reports sent by MAC_KEYS replace all keys and modifiers. They are emitted by
+// tools/macroc.py, which compiles macro source into the fewest reports, and are
+// copied to the report queue as long as it has room.
+//
+// Functions available:
+// --------------------
+// MAC_setTable(table, len) use macros from another table, MAC_setTable(0, 0) for built-in
+// MAC_start(n)             start macro n (a running macro is stopped first)
+// MAC_update()             run next instruction, returns 1 while a macro is running
+// MAC_stop()               stop macro and release all keys
+
+#pragma once
+#include <stdint.h>
+
+// Instructions
+#define MAC_END         0x00
+#define MAC_PRESS       0x01
+#define MAC_RELEASE     0x02
+#define MAC_TYPE        0x03
+#define MAC_CHORD       0x04
+#define MAC_RAW         0x05
+#define MAC_CONSUMER    0x06
+#define MAC_DELAY       0x07
+#define MAC_LAYER       0x08
+#define MAC_RELEASE_ALL 0x09
+#define MAC_KEYS        0x0A        // 0x0A-0x10: report with 0-6 keys
+#define MAC_OPCODES     0x11        // number of opcodes below ASCII
+
+#define MAC_DELAY_ms    10          // unit of MAC_DELAY
+#define MAC_ROOM        (3 * KBD_REPORTS) // free report slots needed for an instruction:
+                                    // release of text, then press and release
+
+// ===================================================================================
+// Custom External Macro Handler Functions
+// ===================================================================================
+void macro_layer(uint8_t n);
+#define MAC_LAYER_handler   macro_layer   // switch layer
+
+// ===================================================================================
+// Functions
+// ===================================================================================
+extern __code uint8_t* __xdata MAC_pc;                    // next instruction, 0 if idle
+
+void MAC_setTable(__code uint8_t* table, uint16_t len);   // select macro table
+void MAC_start(uint8_t n);                                // start macro n
+uint8_t MAC_update(void);                                 // run next instruction
+void MAC_stop(void);                                      // stop macro
+
+#define MAC_busy()  (MAC_pc != 0)                         // macro running
+#define MAC_text(op) (((op) >= 0x20) && ((op) < 0x7F))    // ASCII character
+#define MAC_report(op) ((uint8_t)((op) - MAC_KEYS) <= 6)  // precomputed report
@@ -0,0 +1,86 @@
+// ===================================================================================
+// Timer Tick Functions for CH551, CH552 and CH554
+// ===================================================================================
+
+#include "ch554.h"
+#include "timer.h"
+
+// ===================================================================================
+// Variables
+// ===================================================================================
+volatile uint16_t TMR_ticks = 0;            // milliseconds since start
+volatile __bit TMR_flag = 0;                // set on every tick
+__idata uint8_t TMR_div = TMR_DIV;          // interrupts until next tick
+__idata uint8_t TMR_last[TMR_COUNT];        // last expiry of software timers
+
+// ===================================================================================
+// Start Tick Timer
+// ===================================================================================
+void TMR_init(void) {
+  uint8_t i;
+  for(i=0; i<TMR_COUNT; i++) TMR_last[i] = 0;
+  T2MOD  = (T2MOD & ~bTMR_CLK) | bT2_CLK;   // timer2 clock is Fsys/4
+  T2CON  = 0;                               // 16-bit timer with auto reload
+  RCAP2L = TMR_RELOAD & 0xFF;               // set reload value
+  RCAP2H = TMR_RELOAD >> 8;
+  TL2    = TMR_RELOAD & 0xFF;               // start with a full period
+  TH2    = TMR_RELOAD >> 8;
+  ET2    = 1;                               // enable timer2 interrupt
+  TR2    = 1;                               // start timer2
+}
+
+// ===================================================================================
+// Get Milliseconds
+// ===================================================================================
+uint16_t TMR_millis(void) {
+  uint16_t ticks;
+  ET2   = 0;                                // tick must not change while reading
+  ticks = TMR_ticks;
+  ET2   = 1;
+  return ticks;
+}
+
+// ===================================================================================
+// Wait for Next Tick
+// ===================================================================================
+void TMR_wait(void) {
+  while(!TMR_flag);                         // idle until timer2 ticks
+  TMR_flag = 0;
+}
+
+// ===================================================================================
+// Check Software Timer
+// ===================================================================================
+// The timer is rearmed by its period instead of the current time, so it keeps
+// its phase. If the caller fell behind by more than a period, it is resynced.
+uint8_t TMR_due(uint8_t t, uint8_t period) {
+  uint8_t now = (uint8_t)TMR_millis();
+  uint8_t elapsed = now - TMR_last[t];
+  if(elapsed < period) return 0;
+  if(elapsed >= (uint16_t)period << 1) TMR_last[t] = now;
+  else TMR_last[t] += period;
+  return 1;
+}
+
+// ===================================================================================
+// Timer2 Interrupt Handler
+// ===================================================================================
+#pragma save
+#pragma nooverlay
+void TMR_interrupt(void) {
+  TF2 = 0;                                  // clear interrupt flag
+
+  #ifdef TMR_FAST_handler
+  TMR_FAST_handler();                       // custom fast handler
+  #endif
+
+  if(--TMR_div) return;
+  TMR_div = TMR_DIV;
+  TMR_ticks++;
+  TMR_flag = 1;
+
+  #ifdef TMR_TICK_handler
+  TMR_TICK_handler();                       // custom tick handler
+  #endif
+}
+#pragma restore
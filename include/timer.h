@@ -0,0 +1,60 @@
+// ===================================================================================
+// Timer Tick Functions for CH551, CH552 and CH554
+// ===================================================================================
+//
+// Timer2 runs in 16-bit auto-reload mode at TMR_FREQ and derives a jitter-free
+// 1 kHz tick from it. TMR_FAST_handler is called on every timer2 interrupt, which
+// is used for sampling the rotary encoder, TMR_TICK_handler on every tick, which
+// scans the inputs into the event queue. Software timers are rearmed by their
+// period, so they do not drift no matter how long a pass of the main loop takes.
+//
+// Functions available:
+// --------------------
+// TMR_init()               start the tick timer
+// TMR_millis()             get milliseconds since TMR_init() (16-bit, wraps around)
+// TMR_wait()               idle until the next tick
+// TMR_due(t, period)       returns 1 (and rearms) if software timer t has expired
+//
+// The timer interrupt must be declared in the main file:
+// void TMR_interrupt(void);
+// void TMR2_ISR(void) __interrupt(INT_NO_TMR2) { TMR_interrupt(); }
+//
+// System clock frequency must be at least 6 MHz.
+
+#pragma once
+#include <stdint.h>
+
+// ===================================================================================
+// Timer Frequency
+// ===================================================================================
+#define TMR_FREQ        4000                            // interrupt frequency in Hz
+#define TMR_DIV         (TMR_FREQ / 1000)               // interrupts per 1 ms tick
+#define TMR_RELOAD      (65536 - (FREQ_SYS / 4 / TMR_FREQ))  // timer2 runs at Fsys/4
+
+// ===================================================================================
+// Custom External Timer Handler Functions
+// ===================================================================================
+void ENC_update(void);
+void EVT_update(void);
+#define TMR_FAST_handler    ENC_update    // called at TMR_FREQ (interrupt context)
+#define TMR_TICK_handler    EVT_update    // called every 1 ms tick (interrupt context)
+
+// ===================================================================================
+// Software Timers
+// ===================================================================================
+#define TMR_SCAN        0           // key and encoder timeouts
+#define TMR_LED         1           // LED refresh
+#define TMR_WDT         2           // watchdog feeding
+#define TMR_FLASH       3           // data flash writing
+#define TMR_COUNT       4           // number of software timers
+
+extern volatile uint16_t TMR_ticks;                       // tick count (interrupt context)
+
+// ===================================================================================
+// Functions
+// ===================================================================================
+void TMR_init(void);                                      // start tick timer
+uint16_t TMR_millis(void);                                // get tick count
+void TMR_wait(void);                                      // wait for next tick
+uint8_t TMR_due(uint8_t t, uint8_t period);               // check software timer
+void TMR_interrupt(void);                                 // timer2 interrupt handler
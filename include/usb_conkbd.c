@@ -2,18 +2,37 @@
 // USB HID Consumer Keyboard Functions for CH551, CH552 and CH554
 // ===================================================================================
 
+#include "config.h"
 #include "usb_conkbd.h"
 #include "usb_hid.h"
 #include "usb_handler.h"
 
-#define KBD_sendReport()  HID_sendReport(KBD_report, sizeof(KBD_report))
-#define CON_sendReport()  HID_sendReport(CON_report, sizeof(CON_report))
+// Consumer and mouse reports are not sent in boot protocol
+#define CON_sendReport()  (HID_protocol ? HID_sendReport(CON_report, sizeof(CON_report)) : (void)0)
+#define MSE_sendReport()  (HID_protocol ? HID_sendReport(MSE_report, sizeof(MSE_report)) : (void)0)
+#define SYS_sendReport()  (HID_protocol ? HID_sendReport(SYS_report, sizeof(SYS_report)) : (void)0)
 
 // ===================================================================================
 // Keyboard HID report
 // ===================================================================================
 __xdata uint8_t  KBD_report[9] = {1,0,0,0,0,0,0,0,0};
-__xdata uint8_t  CON_report[9] = {2,0,0,0,0,0,0,0,0};
+__xdata uint8_t  CON_report[3] = {2,0,0};
+__xdata uint8_t  MSE_report[6] = {3,0,0,0,0,0};
+__xdata uint8_t  SYS_report[2] = {5,0};
+
+#if KBD_NKRO
+// N-key rollover report: ID, modifiers, one bit for each key below KBD_NKRO_KEYS.
+// Keys above go into the slots of KBD_report, which is then sent as well.
+__xdata uint8_t  NKRO_report[2 + KBD_NKRO_KEYS / 8] = {4};
+__bit KBD_slotsSent = 0;                        // last KBD_report sent had keys
+#endif
+volatile __bit KBD_changed = 0;                 // protocol changed, clear reports
+
+// Keys held by KBD_stream()
+__xdata uint8_t  KBD_streamKeys[KBD_STREAM_KEYS];
+__xdata uint8_t  KBD_streamCount = 0;           // number of keys held, 0 if idle
+__xdata uint8_t  KBD_streamMod;                 // shift state of the keys held
+__xdata uint8_t  KBD_streamHeld;                // modifiers held before
 
 // ===================================================================================
 // ASCII to keycode mapping table
@@ -31,11 +50,88 @@ __code uint8_t KBD_map[128] = {
   0xb5, 0x00
 };
 
+// ===================================================================================
+// Add key to report, returns 1 if the report has changed
+// ===================================================================================
+uint8_t KBD_add(uint8_t key) {
+  uint8_t i;
+
+  #if KBD_NKRO
+  if(HID_protocol && (key < KBD_NKRO_KEYS)) {   // report protocol: set bit
+    i = 1 << (key & 7);
+    if(NKRO_report[2 + (key >> 3)] & i) return 0;  // already in report
+    NKRO_report[2 + (key >> 3)] |= i;
+    return 1;
+  }
+  #endif
+
+  // Check if key is already present in report
+  for(i=3; i<9; i++) {
+    if(KBD_report[i] == key) return 0;          // return if already in report
+  }
+
+  // Find an empty slot and insert key
+  for(i=3; i<9; i++) {
+    if(KBD_report[i] == 0) {                    // empty slot?
+      KBD_report[i] = key;                      // insert key
+      return 1;
+    }
+  }
+  return 0;                                     // no free slot
+}
+
+// ===================================================================================
+// Remove key from report, returns 1 if the report has changed
+// ===================================================================================
+uint8_t KBD_remove(uint8_t key) {
+  uint8_t i;
+
+  #if KBD_NKRO
+  if(HID_protocol && (key < KBD_NKRO_KEYS)) {   // report protocol: clear bit
+    i = 1 << (key & 7);
+    if(!(NKRO_report[2 + (key >> 3)] & i)) return 0;  // not in report
+    NKRO_report[2 + (key >> 3)] &= ~i;
+    return 1;
+  }
+  #endif
+
+  // Delete key in report
+  for(i=3; i<9; i++) {
+    if(KBD_report[i] == key) {                  // key in report?
+      KBD_report[i] = 0;                        // delete key
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// ===================================================================================
+// Send keyboard report
+// ===================================================================================
+void KBD_sendReport(void) {
+  #if KBD_NKRO
+  uint8_t i, slots = 0;
+  #endif
+  if(!HID_protocol) {                           // boot protocol?
+    HID_sendReport(KBD_report + 1, 8);          // plain report without ID
+    return;
+  }
+  #if KBD_NKRO
+  NKRO_report[1] = KBD_report[1];               // modifiers
+  HID_sendReport(NKRO_report, sizeof(NKRO_report));
+  for(i=3; i<9; i++) slots |= KBD_report[i];    // keys beyond the bitmap?
+  if(slots || KBD_slotsSent) HID_sendReport(KBD_report, sizeof(KBD_report));
+  KBD_slotsSent = (slots != 0);
+  #else
+  HID_sendReport(KBD_report, sizeof(KBD_report));
+  #endif
+}
+
 // ===================================================================================
 // Press a key on keyboard
 // ===================================================================================
 void KBD_press(uint8_t key) {
-  uint8_t i;
+  uint8_t mod = KBD_report[1];                  // modifiers before
 
   // Convert key for HID report
   if(key >= 136) key -= 136;                    // non-printing key/not a modifier?
@@ -52,26 +148,15 @@ void KBD_press(uint8_t key) {
     }
   }
 
-  // Check if key is already present in report
-  for(i=3; i<9; i++) {
-    if(KBD_report[i] == key) return;            // return if already in report
-  }
-
-  // Find an empty slot, insert key and transmit report
-  for(i=3; i<9; i++) {
-    if(KBD_report[i] == 0) {                    // empty slot?
-      KBD_report[i] = key;                      // insert key
-      KBD_sendReport();                         // send report
-      return;                                   // and return
-    }
-  }
+  // Insert key and send report, only if it has changed
+  if((key && KBD_add(key)) || (KBD_report[1] != mod)) KBD_sendReport();
 }
 
 // ===================================================================================
 // Release a key on keyboard
 // ===================================================================================
 void KBD_release(uint8_t key) {
-  uint8_t i;
+  uint8_t mod = KBD_report[1];                  // modifiers before
   if(key >= 136) key -= 136;                    // non-printing key/not a modifier?
   else if(key >= 128) {                         // modifier key?
     KBD_report[1] &= ~(1<<(key-128));           // delete modifier in report
@@ -86,11 +171,8 @@ void KBD_release(uint8_t key) {
     }
   }
 
-  // Delete key in report
-  for(i=3; i<9; i++) {
-    if(KBD_report[i] == key) KBD_report[i] = 0; // delete key in report
-  }
-  KBD_sendReport();                             // send report
+  // Delete key and send report, only if it has changed
+  if((key && KBD_remove(key)) || (KBD_report[1] != mod)) KBD_sendReport();
 }
 
 // ===================================================================================
@@ -101,58 +183,213 @@ void KBD_type(uint8_t key) {
   KBD_release(key);
 }
 
+// ===================================================================================
+// Press and release a key together with modifiers on keyboard
+// ===================================================================================
+// The modifier bits are the same as in the report: (7) RG RA RS RC LG LA LS LC (0).
+// All of them are pressed with the key in one report and released in one report.
+void KBD_chord(uint8_t key, uint8_t mod) {
+
+  // Convert key for HID report
+  if(key >= 136) key -= 136;                    // non-printing key/not a modifier?
+  else if(key >= 128) {                         // modifier key?
+    mod |= (1<<(key-128));                      // add modifier to chord
+    key = 0;
+  }
+  else {                                        // printing key?
+    key = KBD_map[key];                         // convert ascii to keycode for report
+    if(!key) return;                            // no valid key
+    if(key & 0x80) {                            // capital letter/shift character?
+      mod |= 0x02;                              // add left shift modifier
+      key &= 0x7F;                              // remove shift from key itself
+    }
+  }
+  KBD_chordRaw(key, mod);
+}
+
+// ===================================================================================
+// Press and release a HID usage together with modifiers on keyboard
+// ===================================================================================
+// The key is a usage ID of the keyboard page and is sent without translation,
+// usages 0xE0-0xE7 are the modifier keys themselves.
+void KBD_chordRaw(uint8_t key, uint8_t mod) {
+  uint8_t held = KBD_report[1];                 // modifiers held before
+  uint8_t added = 0;                            // key was not pressed before
+
+  if((key & 0xF8) == 0xE0) {                    // modifier usage?
+    mod |= (1<<(key & 7));                      // add modifier to chord
+    key = 0;
+  }
+
+  // Press chord
+  if(key) added = KBD_add(key);                 // insert key
+  KBD_report[1] |= mod;                         // add modifiers
+  if(!added && (KBD_report[1] == held)) return; // nothing changed
+  KBD_sendReport();                             // send report
+
+  // Release chord
+  KBD_report[1] = held;                         // restore modifiers
+  if(added) KBD_remove(key);                    // delete key
+  KBD_sendReport();                             // send report
+}
+
 // ===================================================================================
 // Release all keys on keyboard
 // ===================================================================================
 void KBD_releaseAll(void) {
+  KBD_clear();
+  KBD_sendReport();                             // send report
+}
+
+// ===================================================================================
+// Delete all keys and modifiers in reports without sending them
+// ===================================================================================
+void KBD_clear(void) {
   uint8_t i;
+  KBD_streamCount = 0;                          // stream keys are gone too
   for(i=8; i; i--) KBD_report[i] = 0;           // delete all keys in report
-  KBD_sendReport();                             // send report
+  #if KBD_NKRO
+  for(i=sizeof(NKRO_report)-1; i; i--) NKRO_report[i] = 0;
+  #endif
+}
+
+// ===================================================================================
+// Note a protocol change by the host (called from USB interrupt)
+// ===================================================================================
+// The reports are only cleared by KBD_update() in the main loop, which is the only
+// place they are changed, so a change can not leave one half cleared.
+#pragma save
+#pragma nooverlay
+void KBD_protocolChanged(void) {
+  KBD_changed = 1;
+}
+#pragma restore
+
+// ===================================================================================
+// Clear reports after a protocol change (call from main loop)
+// ===================================================================================
+// Keys held before can then not get stuck in the report that is no longer sent.
+void KBD_update(void) {
+  if(!KBD_changed) return;
+  KBD_changed = 0;
+  KBD_clear();
 }
 
 // ===================================================================================
 // Write text with keyboard
 // ===================================================================================
 void KBD_print(char* str) {
-  while(*str) KBD_type(*str++);
+  while(*str) KBD_stream(*str++);
+  KBD_streamEnd();
 }
 
 // ===================================================================================
-// Press a consumer key on keyboard
+// Type an ASCII character, packed into the report of the characters before
 // ===================================================================================
-void CON_press(uint16_t key) {
-  uint8_t i;
-
-  // Check if key is already present in report
-  for(i=1; i<9; i+=2) {
-    if((CON_report[i] == key & 0xFF) && (CON_report[i+1] == key >> 8)) return;
+// Each character is pressed in a report that still holds the ones typed before,
+// so the host sees exactly one new key per report and keeps the order, and a
+// character costs one report instead of two. The held keys are released
+// together only when a key repeats, the shift state changes or KBD_STREAM_KEYS
+// are held. Call KBD_streamEnd() after the last character.
+void KBD_stream(uint8_t c) {
+  uint8_t i, key, mod;
+  if(c >= 128) {                              // special key: not packed
+    KBD_streamEnd();
+    KBD_type(c);
+    return;
   }
+  key = KBD_map[c];                           // convert ascii to keycode for report
+  if(!key) return;                              // no valid key
+  mod = (key & 0x80) ? 0x02 : 0;                // capital letter/shift character?
+  key &= 0x7F;
 
-  // Find an empty slot, insert key and transmit report
-  for(i=1; i<9; i+=2) {
-    if((CON_report[i] == 0) && (CON_report[i+1] == 0)) {  // empty slot?
-      CON_report[i]   = key & 0xFF;             // insert key
-      CON_report[i+1] = key >> 8;
-      CON_sendReport();                         // send report
-      return;                                   // and return
+  if(KBD_streamCount) {
+    if((mod != KBD_streamMod) || (KBD_streamCount >= KBD_STREAM_KEYS)) KBD_streamEnd();
+    else {
+      for(i=0; i<KBD_streamCount; i++) {
+        if(KBD_streamKeys[i] == key) {          // repeated key: release first
+          KBD_streamEnd();
+          break;
+        }
+      }
     }
   }
+  if(!KBD_streamCount) {                        // start new group of keys
+    KBD_streamHeld = KBD_report[1];
+    KBD_streamMod  = mod;
+    KBD_report[1] |= mod;
+  }
+  if(!KBD_add(key)) {                           // held already or no free slot
+    if(KBD_streamCount) KBD_streamEnd();
+    else KBD_report[1] = KBD_streamHeld;
+    KBD_type(c);                                // type it on its own
+    return;
+  }
+  KBD_streamKeys[KBD_streamCount++] = key;
+  KBD_sendReport();
 }
 
 // ===================================================================================
-// Release a consumer key on keyboard
+// Release characters held by KBD_stream()
 // ===================================================================================
-void CON_release(uint16_t key) {
+void KBD_streamEnd(void) {
   uint8_t i;
+  if(!KBD_streamCount) return;
+  for(i=0; i<KBD_streamCount; i++) KBD_remove(KBD_streamKeys[i]);
+  KBD_report[1] = KBD_streamHeld;               // restore modifiers
+  KBD_streamCount = 0;
+  KBD_sendReport();                             // send report
+}
 
-  // Delete key in report
-  for(i=1; i<9; i+=2) {
-    if((CON_report[i] == key & 0xFF) && (CON_report[i+1] == key >> 8)) {
-      CON_report[i]   = 0;
-      CON_report[i+1] = 0;
+// ===================================================================================
+// Replace modifiers and keys with a precomputed report and send it
+// ===================================================================================
+// mod holds the modifier bits of the report, keys n keyboard usages (up to six).
+// Keys held before, also by KBD_stream(), are released by it.
+void KBD_setKeys(uint8_t mod, __code uint8_t* keys, uint8_t n) {
+  uint8_t i;
+  KBD_streamCount = 0;
+  KBD_report[1] = mod;
+
+  #if KBD_NKRO
+  if(HID_protocol) {                            // report protocol: set bits
+    for(i=2; i<sizeof(NKRO_report); i++) NKRO_report[i] = 0;
+    for(i=3; i<9; i++) KBD_report[i] = 0;
+    while(n--) KBD_add(*keys++);
+    KBD_sendReport();
+    return;
+  }
+  #endif
+
+  for(i=3; i<9; i++) {                          // copy keys to slots
+    if(n) {
+      KBD_report[i] = *keys++;
+      n--;
     }
+    else KBD_report[i] = 0;
   }
-  CON_sendReport();
+  KBD_sendReport();
+}
+
+// ===================================================================================
+// Press a consumer key on keyboard
+// ===================================================================================
+// The report holds one 16-bit usage, a new key replaces the one held before.
+void CON_press(uint16_t key) {
+  if((CON_report[1] == (key & 0xFF)) && (CON_report[2] == (key >> 8))) return;
+  CON_report[1] = key & 0xFF;                   // insert key
+  CON_report[2] = key >> 8;
+  CON_sendReport();                             // send report
+}
+
+// ===================================================================================
+// Release a consumer key on keyboard
+// ===================================================================================
+void CON_release(uint16_t key) {
+  if((CON_report[1] != (key & 0xFF)) || (CON_report[2] != (key >> 8))) return;
+  CON_report[1] = 0;                            // delete key
+  CON_report[2] = 0;
+  CON_sendReport();                             // send report
 }
 
 // ===================================================================================
@@ -167,11 +404,32 @@ void CON_type(uint16_t key) {
 // Release all consumer keys on keyboard
 // ===================================================================================
 void CON_releaseAll(void) {
-  uint8_t i;
-  for(i=8; i; i--) CON_report[i] = 0;           // delete all keys in report
+  CON_report[1] = 0;                            // delete key in report
+  CON_report[2] = 0;
   CON_sendReport();                             // send report
 }
 
+// ===================================================================================
+// Press and release a system control key
+// ===================================================================================
+void SYS_type(uint8_t key) {
+  SYS_report[1] = key;                          // insert key
+  SYS_sendReport();                             // send report
+  SYS_report[1] = 0;                            // delete key
+  SYS_sendReport();                             // send report
+}
+
+// ===================================================================================
+// Scroll mouse wheel (vertical) and AC pan (horizontal) by relative steps
+// ===================================================================================
+void MSE_scroll(int8_t wheel, int8_t pan) {
+  MSE_report[4] = wheel;
+  MSE_report[5] = pan;
+  MSE_sendReport();                             // send report
+  MSE_report[4] = 0;                            // relative values are sent once
+  MSE_report[5] = 0;
+}
+
 // ===================================================================================
 // Get keyboard status LEDs
 // ===================================================================================
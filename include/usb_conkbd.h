@@ -4,20 +4,45 @@
 
 #pragma once
 #include <stdint.h>
+#include "config.h"
 #include "usb_hid.h"
 
+// N-key rollover report covers keys 0x00..KBD_NKRO_KEYS-1 (enabled by KBD_NKRO)
+#define KBD_NKRO_KEYS   160
+
+// Keys held at most by KBD_stream() before they are released together
+#define KBD_STREAM_KEYS 6
+
+// Reports queued by one KBD_sendReport() at most: with N-key rollover the bitmap,
+// then the report of the keys beyond it
+#if KBD_NKRO
+#define KBD_REPORTS     2
+#else
+#define KBD_REPORTS     1
+#endif
+
 // Functions
 #define KBD_init() HID_init()         // init keyboard
 void KBD_press(uint8_t key);          // press a key on keyboard
 void KBD_release(uint8_t key);        // release a key on keyboard
 void KBD_type(uint8_t key);           // press and release a key on keyboard
+void KBD_chord(uint8_t key, uint8_t mod);  // press and release a key with modifiers
+void KBD_chordRaw(uint8_t key, uint8_t mod);  // same with a HID usage instead of ASCII
 void KBD_releaseAll(void);            // release all keys on keyboard
+void KBD_clear(void);                 // delete all keys in reports without sending
+void KBD_update(void);                // clear reports if the host changed the protocol
 void KBD_print(char* str);            // type some text on the keyboard
+void KBD_stream(uint8_t c);           // type ASCII character, packed with the ones before
+void KBD_streamEnd(void);             // release characters held by KBD_stream()
+void KBD_setKeys(uint8_t mod, __code uint8_t* keys, uint8_t n);  // send precomputed report
 
 void CON_press(uint16_t key);         // press a consumer key on keyboard
 void CON_release(uint16_t key);       // release a consumer key on keyboard
 void CON_type(uint16_t key);          // press and release a consumer key
 void CON_releaseAll(void);            // release all consumer keys on keyboard
+void SYS_type(uint8_t key);           // press and release a system control key
+
+void MSE_scroll(int8_t wheel, int8_t pan);  // scroll mouse wheel (relative steps)
 
 uint8_t KBD_getState(void);           // get keyboard status LEDs
 
@@ -108,3 +133,18 @@ uint8_t KBD_getState(void);           // get keyboard status LEDs
 #define CON_MENU_ESCAPE     0x46
 #define CON_MENU_INCR       0x47
 #define CON_MENU_DECR       0x48
+
+#define CON_BRIGHT_UP       0x6F
+#define CON_BRIGHT_DOWN     0x70
+
+#define CON_AL_EMAIL        0x18A
+#define CON_AL_CALCULATOR   0x192
+#define CON_AL_FILES        0x194
+#define CON_AL_BROWSER      0x196
+#define CON_AC_SEARCH       0x221
+#define CON_AC_HOME         0x223
+
+// System Control Keycodes
+#define SYS_POWER_DOWN      0x81
+#define SYS_SLEEP           0x82
+#define SYS_WAKE_UP         0x83
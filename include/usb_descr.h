@@ -20,7 +20,7 @@
 // USB Endpoint Addresses and Sizes
 // ===================================================================================
 #define EP0_SIZE        64
-#define EP1_SIZE        16
+#define EP1_SIZE        32
 #define EP2_SIZE        16
 
 #define EP0_ADDR        0
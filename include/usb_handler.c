@@ -117,6 +117,10 @@ void USB_EP0_SETUP(void) {
             if(SetupLen > len) SetupLen = len;    // limit length
             len = SetupLen >= EP0_SIZE ? EP0_SIZE : SetupLen;
             USB_EP0_copyDescr(len);               // copy descriptor to Ep0
+            #ifdef USB_CFG_DESCR_handler
+            if(pDescr == (uint8_t*)&CfgDescr)     // runtime values in config descriptor
+              USB_CFG_DESCR_handler(len);
+            #endif
             SetupLen -= len;
             pDescr += len;
           }
@@ -316,6 +320,13 @@ void USB_EP0_IN(void) {
 }
 
 void USB_EP0_OUT(void) {
+  #ifdef USB_CTRL_OUT_handler
+  if(U_TOG_OK && USB_CTRL_OUT_handler(USB_RX_LEN)) {  // data of non-standard request?
+    UEP0_T_LEN = 0;                               // answer status stage
+    UEP0_CTRL = UEP0_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_ACK;
+    return;
+  }
+  #endif
   UEP0_T_LEN = 0;
   UEP0_CTRL |= UEP_R_RES_ACK | UEP_T_RES_NAK;     // respond Nak
 }
@@ -23,6 +23,9 @@ void HID_setup(void);
 void HID_reset(void);
 void HID_EP1_IN(void);
 void HID_EP2_OUT(void);
+void HID_patchCfgDescr(uint8_t len);
+uint8_t HID_control(void);
+uint8_t HID_controlOut(uint8_t len);
 
 // ===================================================================================
 // USB Handler Defines
@@ -30,6 +33,9 @@ void HID_EP2_OUT(void);
 // Custom USB handler functions
 #define USB_INIT_handler    HID_setup         // init custom endpoints
 #define USB_RESET_handler   HID_reset         // custom USB reset handler
+#define USB_CFG_DESCR_handler HID_patchCfgDescr // patch configuration descriptor
+#define USB_CTRL_NS_handler HID_control       // HID class requests
+#define USB_CTRL_OUT_handler HID_controlOut   // data stage of HID class requests
 
 // Endpoint callback functions
 #define EP0_SETUP_callback  USB_EP0_SETUP
@@ -2,6 +2,7 @@
 // USB HID Functions for CH551, CH552 and CH554
 // ===================================================================================
 
+#include <stddef.h>
 #include "ch554.h"
 #include "usb.h"
 #include "usb_hid.h"
@@ -14,6 +15,24 @@
 
 volatile __bit HID_EP1_writeBusyFlag = 0;                   // upload pointer busy flag
 
+// Queue of reports waiting for the host, filled by HID_sendReport() and
+// drained by HID_EP1_IN() whenever the host has taken the previous report
+__xdata uint8_t HID_queue[HID_QUEUE_SIZE][HID_REPORT_SIZE]; // report data
+__xdata uint8_t HID_queueLen[HID_QUEUE_SIZE];               // report lengths
+volatile __idata uint8_t HID_head = 0;                      // next slot to fill
+volatile __idata uint8_t HID_tail = 0;                      // next slot to send
+__idata uint8_t HID_overflow = 0;                           // times the queue was full
+
+#define HID_next(i) (((i) + 1) & (HID_QUEUE_SIZE - 1))
+
+__idata uint8_t HID_interval = 10;                          // polling interval in ms
+__idata uint8_t HID_protocol = 1;                           // report protocol after reset
+__bit HID_setFeature = 0;                                   // feature report data expected
+
+// Position of polling intervals in configuration descriptor
+#define HID_EP1_INTERVAL  (offsetof(USB_CFG_DESCR_HID, ep1IN)  + offsetof(USB_ENDP_DESCR, bInterval))
+#define HID_EP2_INTERVAL  (offsetof(USB_CFG_DESCR_HID, ep2OUT) + offsetof(USB_ENDP_DESCR, bInterval))
+
 // ===================================================================================
 // Front End Functions
 // ===================================================================================
@@ -24,15 +43,45 @@ void HID_init(void) {
   UEP1_T_LEN  = 0;
 }
 
-// Send HID report
+// Send HID report (queued, only waits if the queue is full)
 void HID_sendReport(__xdata uint8_t* buf, uint8_t len) {
   uint8_t i;
-  while(HID_EP1_writeBusyFlag);                             // wait for ready to write
-  for(i=0; i<len; i++) EP1_buffer[i] = buf[i];              // copy report to EP1 buffer
+  uint8_t next = HID_next(HID_head);
+  if(next == HID_tail) {                                    // queue full?
+    if(HID_overflow < 255) HID_overflow++;                  // count it
+    while(next == HID_tail);                                // wait for a free slot
+  }
+  if(len > HID_REPORT_SIZE) len = HID_REPORT_SIZE;
+  for(i=0; i<len; i++) HID_queue[HID_head][i] = buf[i];     // copy report to queue
+  HID_queueLen[HID_head] = len;
+  HID_head = next;
+  IE_USB = 0;                                               // EP1 must not change now
+  if(!HID_EP1_writeBusyFlag) HID_EP1_load();                // endpoint idle: send now
+  IE_USB = 1;
+}
+
+// ===================================================================================
+// Load Next Queued Report into EP1 Buffer
+// ===================================================================================
+// Called from USB interrupt or with USB interrupt disabled.
+#pragma save
+#pragma nooverlay
+void HID_EP1_load(void) {
+  uint8_t i, len;
+  if(HID_tail == HID_head) {                                // queue empty?
+    UEP1_T_LEN = 0;                                         // no data to send anymore
+    UEP1_CTRL = UEP1_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_NAK;  // default NAK
+    HID_EP1_writeBusyFlag = 0;                              // clear busy flag
+    return;
+  }
+  len = HID_queueLen[HID_tail];
+  for(i=0; i<len; i++) EP1_buffer[i] = HID_queue[HID_tail][i];  // copy report to EP1
+  HID_tail = HID_next(HID_tail);
   UEP1_T_LEN = len;                                         // set length to upload
   HID_EP1_writeBusyFlag = 1;                                // set busy flag
   UEP1_CTRL = UEP1_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_ACK;  // upload data and respond ACK
 }
+#pragma restore
 
 // ===================================================================================
 // HID-Specific USB Handler Functions
@@ -55,13 +104,70 @@ void HID_reset(void) {
   UEP1_CTRL = bUEP_AUTO_TOG | UEP_T_RES_NAK;
   UEP2_CTRL = bUEP_AUTO_TOG | UEP_R_RES_ACK;
   HID_EP1_writeBusyFlag = 0;
+  HID_head = 0;
+  HID_tail = 0;
+  HID_protocol = 1;
+  HID_setFeature = 0;
+}
+
+// Handle HID class requests on EP0, returns length of data or 0xFF if unsupported
+uint8_t HID_control(void) {
+  uint8_t len;
+  HID_setFeature = 0;                                       // new request
+  if((USB_setupBuf->bRequestType & USB_REQ_TYP_MASK) != USB_REQ_TYP_CLASS) return 0xFF;
+  switch(SetupReq) {
+    #ifdef HID_GET_FEATURE_handler
+    case HID_GET_REPORT:
+      if((USB_setupBuf->wValueH != 3) || (USB_setupBuf->wValueL != HID_FEATURE_ID)) return 0xFF;
+      len = HID_GET_FEATURE_handler(EP0_buffer);
+      if(len > USB_setupBuf->wLengthL) len = USB_setupBuf->wLengthL;
+      return len;
+    #endif
+    #ifdef HID_SET_FEATURE_handler
+    case HID_SET_REPORT:
+      if((USB_setupBuf->wValueH != 3) || (USB_setupBuf->wValueL != HID_FEATURE_ID)) return 0xFF;
+      HID_setFeature = 1;                                   // report follows in data stage
+      return 0;
+    #endif
+    case HID_SET_PROTOCOL:
+      HID_protocol = USB_setupBuf->wValueL;                 // 0: boot, 1: report
+      #ifdef HID_PROTOCOL_handler
+      HID_PROTOCOL_handler();                               // reports change layout
+      #endif
+      return 0;
+    case HID_GET_PROTOCOL:
+      EP0_buffer[0] = HID_protocol;
+      return 1;
+    case HID_SET_IDLE:                                      // reports are sent on change only
+      return 0;
+    case HID_GET_IDLE:
+      EP0_buffer[0] = 0;                                    // infinite idle rate
+      return 1;
+    default:
+      return 0xFF;                                          // not supported
+  }
+}
+
+// Handle data stage of HID class requests, returns 1 if the data was taken
+uint8_t HID_controlOut(uint8_t len) {
+  if(!HID_setFeature) return 0;
+  HID_setFeature = 0;
+  #ifdef HID_SET_FEATURE_handler
+  if((len == HID_FEATURE_SIZE) && (EP0_buffer[0] == HID_FEATURE_ID))
+    HID_SET_FEATURE_handler(EP0_buffer);
+  #endif
+  return 1;
+}
+
+// Patch polling interval into configuration descriptor copied to EP0 buffer
+void HID_patchCfgDescr(uint8_t len) {
+  if(len > HID_EP1_INTERVAL) EP0_buffer[HID_EP1_INTERVAL] = HID_interval;
+  if(len > HID_EP2_INTERVAL) EP0_buffer[HID_EP2_INTERVAL] = HID_interval;
 }
 
 // Endpoint 1 IN handler (HID report transfer to host)
 void HID_EP1_IN(void) {
-  UEP1_T_LEN = 0;                                           // no data to send anymore
-  UEP1_CTRL = UEP1_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_NAK;  // default NAK
-  HID_EP1_writeBusyFlag = 0;                                // clear busy flag
+  HID_EP1_load();                                           // send next report, if any
 }
 
 // Endpoint 2 OUT handler (HID report transfer from host)
@@ -5,5 +5,32 @@
 #pragma once
 #include <stdint.h>
 
+#define HID_QUEUE_SIZE  8                                 // queued reports (power of 2)
+#define HID_REPORT_SIZE 22                                // max report length incl. ID
+
+extern volatile __idata uint8_t HID_head;
+extern volatile __idata uint8_t HID_tail;
+extern __idata uint8_t HID_overflow;                      // times the queue was full
+extern __idata uint8_t HID_interval;                      // polling interval in ms, set before init
+extern __idata uint8_t HID_protocol;                      // 0: boot protocol, 1: report protocol
+
+// ===================================================================================
+// Custom External Feature Report Handler Functions (called from USB interrupt)
+// ===================================================================================
+#define HID_FEATURE_ID  6                                 // vendor feature report ID
+#define HID_FEATURE_SIZE 32                               // feature report length incl. ID
+
+uint8_t config_get_report(__xdata uint8_t* buf);          // baked build: statistics only
+void config_set_report(__xdata uint8_t* buf);
+#define HID_GET_FEATURE_handler config_get_report         // fill report, returns length
+#define HID_SET_FEATURE_handler config_set_report         // report received from host
+
+void KBD_protocolChanged(void);
+#define HID_PROTOCOL_handler    KBD_protocolChanged       // protocol changed by host
+
 void HID_init(void);                                      // setup USB-HID
-void HID_sendReport(__xdata uint8_t* buf, uint8_t len);   // send HID report
+void HID_sendReport(__xdata uint8_t* buf, uint8_t len);   // queue HID report
+void HID_EP1_load(void);                                  // load next report into EP1
+
+#define HID_ready() (HID_head == HID_tail)                // no report waiting in queue
+#define HID_free()  ((uint8_t)(HID_tail - HID_head - 1) & (HID_QUEUE_SIZE - 1))  // free slots
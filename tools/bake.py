@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+# ===================================================================================
+# bake - turn a 3keys_1knob configuration into constant firmware tables
+# ===================================================================================
+#
+# Usage:
+#   python3 tools/bake.py flashdata.bin include/keymap_baked.h [keymap.bin]
+#
+# Reads a data flash image (legacy or version 2 layout) and writes a header of
+# __code tables, indexed by layer and event. "make bake" builds the firmware with
+# it: the keymap is then fixed, data flash is not read at power-up and the keymap
+# can not be changed over USB. Empty layers at the end are left out.
+#
+# The tap/hold section, chord section and macro table of keymap.bin are baked as
+# well. Its layer records are not: banks of code flash layers do not exist in a
+# baked build, so a keymap.bin with layers is rejected, as are bank actions (0xF2).
+
+import sys
+import flashdata
+
+# Order of enum Event in 3keys_1knob.c after NONE: offsets of (modifier, character)
+EVENTS = [
+    ('KEY1',       0,  1),
+    ('KEY2',       2,  3),
+    ('KEY3',       4,  5),
+    ('ENC_SW',     6,  7),
+    ('ENC_CW',     8,  9),
+    ('ENC_CCW',    10, 11),
+    ('KEY12',      12, 13),
+    ('KEY23',      14, 15),
+    ('KEY13',      16, 17),
+    ('ENC_SW_CW',  20, 18),
+    ('ENC_SW_CCW', 21, 19),
+]
+KEYS = 22                                   # key bytes in a record
+TH_ACTIONS = 8                              # tap/hold section: times, then actions
+CH_LAYER = 16 * 3 * 2                       # chord section: bytes per layer
+MOD_BANK = 0xF2                             # bank action, no banks in a baked build
+
+
+def records(img):
+    if img[0:2] != flashdata.MAGIC:
+        img = flashdata.convert(img)
+    base = flashdata.HEADER
+    return [img[base + n * flashdata.LAYER:base + (n + 1) * flashdata.LAYER] for n in range(4)]
+
+
+def sections(data):
+    """Tap/hold section, chord section and macro table of keymap.bin"""
+    if data[0] & 0x3F:
+        sys.exit('keymap.bin has layer records, a baked build has no banks')
+    taphold = flashdata.TAPHOLD_SIZE if data[0] & 0x80 else 0
+    chords = flashdata.CHORDS_SIZE if data[0] & 0x40 else 0
+    body = bytes(data[1:])
+    if taphold + chords > len(body):
+        sys.exit('keymap too short')
+    return body[:taphold], body[taphold:taphold + chords], body[taphold + chords:]
+
+
+def check_banks(where, pairs):
+    for mod, key in pairs:
+        if mod == MOD_BANK and key:
+            sys.exit('%s: bank action 0xF2, a baked build has no banks' % where)
+
+
+def table(name, data):
+    out = ['__code uint8_t %s[%d] = {' % (name, len(data))]
+    for i in range(0, len(data), 16):
+        out.append('  %s,' % ', '.join('0x%02X' % b for b in data[i:i + 16]))
+    return out + ['};', '']
+
+
+def bake(img, kmap=None):
+    taphold, chords, macros = sections(kmap) if kmap else (b'', b'', b'')
+    th_layers = ch_layers = 0               # layers with tap/hold or chord actions
+    for n in range(4):
+        if any(taphold[TH_ACTIONS + n * 12:TH_ACTIONS + n * 12 + 12]):
+            th_layers |= 1 << n
+        if any(chords[n * CH_LAYER + 1:(n + 1) * CH_LAYER:2]):  # key bytes
+            ch_layers |= 1 << n
+    layers = records(img)
+    while len(layers) > 1 and not any(layers[-1][0:KEYS]) \
+            and not ((th_layers | ch_layers) >> (len(layers) - 1)) & 1:
+        layers.pop()                        # never used
+    for n, rec in enumerate(layers):
+        check_banks('layer %d' % n, [(rec[m], rec[c]) for _, m, c in EVENTS])
+    check_banks('tap/hold section', zip(taphold[TH_ACTIONS::2], taphold[TH_ACTIONS + 1::2]))
+    check_banks('chord section', zip(chords[0::2], chords[1::2]))
+    combos = 0
+    for n, rec in enumerate(layers):
+        if rec[13] | rec[15] | rec[17]:
+            combos |= 1 << n
+
+    out = ['// Generated by tools/bake.py, do not edit',
+           '#pragma once',
+           '',
+           '#define BAKED_LAYERS  %d' % len(layers),
+           '#define BAKED_COMBOS  0x%02X          // layers with key combinations' % combos,
+           '',
+           '// Action of each event, indexed by layer and enum Event - 1',
+           '__code struct Action baked_keys[BAKED_LAYERS][LAYER_EVENTS] = {']
+    for n, rec in enumerate(layers):
+        out.append('  {  // layer %d' % n)
+        for name, m, c in EVENTS:
+            out.append('    { 0x%02X, 0x%02X },  // %s' % (rec[m], rec[c], name))
+        out.append('  },')
+    out += ['};',
+            '',
+            '// Foreground, background, fade step and option byte of each layer',
+            '__code uint8_t baked_layers[BAKED_LAYERS][8] = {']
+    for rec in layers:
+        out.append('  { %s },' % ', '.join('0x%02X' % b for b in rec[KEYS:]))
+    out += ['};', '']
+    if taphold:
+        out += ['// Tap/hold section of keymap.bin', '#define BAKED_TAPHOLD']
+        out += table('baked_taphold', taphold)
+    if chords:
+        out += ['// Chord section of keymap.bin',
+                '#define BAKED_CHORDS  0x%02X          // layers with chord actions' % ch_layers]
+        out += table('baked_chords', chords)
+    if macros:
+        out += ['// Macro table of keymap.bin', '#define BAKED_MACROS']
+        out += table('baked_macros', macros)
+    return '\n'.join(out)
+
+
+def main():
+    if len(sys.argv) not in (3, 4):
+        sys.exit('usage: bake.py flashdata.bin keymap_baked.h [keymap.bin]')
+    with open(sys.argv[1], 'rb') as f:
+        img = bytearray(f.read().ljust(flashdata.SIZE, b'\0')[:flashdata.SIZE])
+    kmap = None
+    if len(sys.argv) == 4:
+        with open(sys.argv[3], 'rb') as f:
+            kmap = f.read()
+    with open(sys.argv[2], 'w') as f:
+        f.write(bake(img, kmap))
+
+
+if __name__ == '__main__':
+    main()
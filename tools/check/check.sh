@@ -0,0 +1,46 @@
+#!/bin/sh
+# ===================================================================================
+# Host checks: build the firmware with gcc and run the drivers in this directory
+# ===================================================================================
+#
+# Usage: tools/check/check.sh (from the repository root, or "make check")
+#
+# Inline assembly and SDCC pragmas are stripped, memory space qualifiers dropped and
+# special function registers become variables (compiler.h). The firmware's main()
+# is renamed, each driver calls the functions it checks. The macro compiler is
+# checked with the examples in tools/macroc.py.
+
+set -e
+CHECK=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(cd "$CHECK/../.." && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+mkdir -p "$TMP/include"
+for f in "$ROOT"/3keys_1knob.c "$ROOT"/include/*.c "$ROOT"/include/*.h; do
+  python3 - "$f" > "$TMP/${f#$ROOT/}" <<'PY'
+import re, sys
+s = open(sys.argv[1]).read()
+s = re.sub(r'__asm\b(?!__).*?__endasm\s*;', ';', s, flags=re.S)
+s = re.sub(r'#pragma (save|restore|nooverlay|callee_saves).*', '', s)
+print(s)
+PY
+done
+rm "$TMP/include/usb_descr.c"
+
+for f in "$TMP"/3keys_1knob.c "$TMP"/include/*.c; do
+  gcc -c -std=gnu11 -funsigned-char -fcommon -w -I"$CHECK" -I"$TMP/include" \
+    -DFREQ_SYS=16000000 -Dmain=firmware_main -include stdint.h \
+    -D__idata= -D__xdata= -D__data= -D__pdata= -D__code=const -D__bit=_Bool \
+    -D'__interrupt(x)=' -D'__at(x)=' -D'__using(x)=' -D__naked= -D__reentrant= \
+    -D__critical= "$f" -o "$f.o"
+done
+
+for d in "$CHECK"/*.c; do
+  [ "$d" = "$CHECK/stubs.c" ] && continue
+  gcc -std=gnu11 -funsigned-char -fcommon -w "$d" "$CHECK/stubs.c" "$TMP"/*.o \
+    "$TMP"/include/*.o -o "$TMP/check"
+  "$TMP/check"
+done
+
+python3 -m doctest "$ROOT/tools/macroc.py" && echo "macroc: ok"
@@ -0,0 +1,7 @@
+// Host stand-in for SDCC's compiler.h: special function registers are plain variables
+#pragma once
+#define SFR(n,a)      volatile unsigned char n
+#define SFR16(n,a)    volatile unsigned short n
+#define SFR32(n,a)    volatile unsigned long n
+#define SFR32E(n,a)   volatile unsigned long n
+#define SBIT(n,a,b)   volatile unsigned char n
@@ -0,0 +1,40 @@
+// Layer stack with the shipped default configuration (data flash blank)
+#include <stdio.h>
+#include <stdint.h>
+
+struct Action { uint8_t mod; uint8_t key; };
+extern struct Action keymap[4][13];
+extern uint8_t layer, max_layer, option[];
+extern volatile uint8_t EVT_state;
+extern uint16_t EVT_time;
+uint8_t load_config(void);
+void layer_to(uint8_t n);
+void layer_release(uint8_t hold);
+void parse_keys(uint16_t now);
+void parse_encoder(int8_t steps, uint16_t turned);
+
+static int failed = 0;
+
+static void expect(const char *what, int got, int want) {
+  if (got != want) { printf("FAIL %s: %d, expected %d\n", what, got, want); failed = 1; }
+}
+
+// One switch event, as handled by the main loop
+static void event(uint8_t state, uint16_t time) {
+  EVT_state = state; EVT_time = time;
+  parse_keys(time); parse_encoder(0, 0); layer_release(state);
+}
+
+int main(void) {
+  load_config();                            // falls back to config_default
+  max_layer = option[0] & 3;
+  layer_to(0);
+  expect("max_layer of config_default", max_layer, 0);
+  keymap[0][0].mod = 0xF3; keymap[0][0].key = 0x11;  // key 1: layer 1 while held
+  event(0x01, 100);
+  expect("layer while key 1 is held", layer, 1);
+  event(0x00, 150);
+  expect("layer after key 1 is released", layer, 0);
+  if (!failed) { puts("layers: ok"); }
+  return failed;
+}
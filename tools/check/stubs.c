@@ -0,0 +1,8 @@
+// Hardware and USB descriptor symbols the host build does not compile
+#include <stdint.h>
+
+void BOOT_now(void) {}
+void CLK_config(void) {}
+void WDT_start(void) {}
+const uint8_t DevDescr[18], CfgDescr[64], InterfDescr[4], ReportDescr[1], ReportDescrLen;
+const uint16_t LangDescr[1], ManufDescr[4], ProdDescr[4], SerDescr[4];
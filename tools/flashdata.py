@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+# ===================================================================================
+# flashdata - convert and check 3keys_1knob data flash images
+# ===================================================================================
+#
+# Usage:
+#   python3 tools/flashdata.py crc flashdata.bin       update CRC of a version 2 image
+#   python3 tools/flashdata.py convert flashdata.bin   convert a legacy image to version 2
+#   python3 tools/flashdata.py push flashdata.bin      send image to running pad and save it
+#   python3 tools/flashdata.py pull flashdata.bin      read configuration from running pad
+#   python3 tools/flashdata.py push-keymap keymap.bin  send keymap region to running pad
+#   python3 tools/flashdata.py pull-keymap keymap.bin  read keymap region from running pad
+#   python3 tools/flashdata.py stats                   show input and flash statistics
+#
+# keymap.bin holds layer records in the version 2 layout (30 bytes each, banks of
+# four layers selected with modifier 0xF2), optional tap/hold and chord sections
+# and an optional macro table. Its first byte is the number of layer records, with
+# bit 7 set if the tap/hold section is present and bit 6 set if the chord section
+# is present; the region header is added here.
+#
+# Tap/hold section (56 bytes): hold threshold of keys 1-3 and double tap window of
+# keys 1-3 (in 10 ms, 0 for the default), 2 reserved bytes, then for layers 0-3 the
+# hold actions of keys 1-3 and the double tap actions of keys 1-3 (modifier, key).
+#
+# Chord section (384 bytes): for layers 0-3 and each mask 0-15 of switches held
+# (1 key 1, 2 key 2, 4 key 3, 8 knob switch) the actions sent on release, on a
+# clockwise and on a counter-clockwise knob step (modifier, key each).
+#
+# Legacy images (without header) are left alone by "crc", so "make data" works for
+# both layouts. Converting keeps everything except per-channel fade steps: the red
+# fade step is used for all channels.
+#
+# push and pull talk to the firmware over a vendor HID feature report and need
+# hidapi ("pip install hidapi"). Only version 2 images can be pushed.
+
+import sys
+import time
+
+SIZE    = 128
+HEADER  = 8
+LAYER   = 30
+MAGIC   = b'3K'
+VERSION = 2
+
+VID     = 0x1189
+PID     = 0x8890
+REPORT  = 6                                 # feature report ID
+CHUNK   = 28                                # data bytes per report
+CMD_READ, CMD_WRITE, CMD_APPLY, CMD_SAVE = 1, 2, 3, 4
+CMD_KMAP_READ, CMD_KMAP_WRITE = 5, 6
+CMD_STATS, CMD_KMAP_APPLY = 7, 8
+
+KMAP_SIZE   = 0x800                         # keymap region in code flash
+KMAP_BLOCK  = 16                            # region offsets are in blocks of 16 bytes
+KMAP_TAPHOLD = 0x01                         # header flag: tap/hold section present
+KMAP_CHORDS  = 0x02                         # header flag: chord section present
+TAPHOLD_SIZE = 8 + 4 * 6 * 2
+CHORDS_SIZE  = 4 * 16 * 3 * 2
+OK, BUSY, ERROR = 0, 1, 2
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def set_crc(img):
+    crc = crc16(img[HEADER:SIZE])
+    img[4] = crc & 0xFF
+    img[5] = crc >> 8
+
+
+def convert(old):
+    img = bytearray(SIZE)
+    img[0:2] = MAGIC
+    img[2] = VERSION
+    for n in range(4):
+        p = old[n * 32:(n + 1) * 32]
+        rec = bytearray()
+        rec += p[0:12]                      # keys, switch, encoder
+        rec += p[16:24]                     # combos, encoder pressed characters
+        rec += bytes([p[27], p[31]])        # encoder pressed modifiers
+        rec += p[12:15]                     # foreground
+        rec += p[28:31]                     # background
+        rec += bytes([p[24], p[15]])        # fade, option
+        img[HEADER + n * LAYER:HEADER + (n + 1) * LAYER] = rec
+    return img
+
+
+def open_pad():
+    import hid
+    devs = [d for d in hid.enumerate(VID, PID) if d.get('usage_page', 0xFF00) == 0xFF00]
+    if not devs:
+        sys.exit('pad not found')
+    dev = hid.device()
+    dev.open_path(devs[0]['path'])
+    return dev
+
+
+def wait(dev):
+    while True:
+        reply = dev.get_feature_report(REPORT, 32)
+        if reply[1] != BUSY:
+            return reply
+        time.sleep(0.01)
+
+
+def command(dev, cmd, offset=0, data=b'', count=None):
+    count = len(data) if count is None else count
+    report = bytes([REPORT, cmd, offset, count]) + bytes(data)
+    wait(dev)                               # pad may still be saving
+    dev.send_feature_report(list(report.ljust(32, b'\0')))
+    reply = wait(dev)
+    if reply[1] != OK:
+        sys.exit('pad rejected command %d' % cmd)
+    return bytes(reply[4:4 + reply[3]])
+
+
+def push(img):
+    dev = open_pad()
+    for offset in range(0, SIZE, CHUNK):
+        command(dev, CMD_WRITE, offset, img[offset:offset + CHUNK])
+    command(dev, CMD_SAVE)
+
+
+def pull():
+    dev = open_pad()
+    img = bytearray()
+    for offset in range(0, SIZE, CHUNK):
+        img += command(dev, CMD_READ, offset, count=min(CHUNK, SIZE - offset))
+    return img
+
+
+def keymap_region(data):
+    layers, body = data[0] & 0x3F, bytes(data[1:])
+    flags = (KMAP_TAPHOLD if data[0] & 0x80 else 0) | (KMAP_CHORDS if data[0] & 0x40 else 0)
+    if len(body) % 2:
+        body += b'\0'                      # written in 16-bit words
+    sections = layers * LAYER
+    sections += TAPHOLD_SIZE if flags & KMAP_TAPHOLD else 0
+    sections += CHORDS_SIZE if flags & KMAP_CHORDS else 0
+    if 8 + len(body) > KMAP_SIZE or sections > len(body):
+        sys.exit('keymap too large or too short')
+    crc = crc16(body)
+    n = len(body)
+    return b'KM' + bytes([layers, flags, n & 0xFF, n >> 8, crc & 0xFF, crc >> 8]) + body
+
+
+def push_keymap(region):
+    dev = open_pad()
+    for offset in range(0, len(region), KMAP_BLOCK):
+        command(dev, CMD_KMAP_WRITE, offset // KMAP_BLOCK, region[offset:offset + KMAP_BLOCK])
+    command(dev, CMD_KMAP_APPLY)            # check region, configuration is unchanged
+
+
+def pull_keymap():
+    dev = open_pad()
+    head = command(dev, CMD_KMAP_READ, 0, count=8)
+    if head[0:2] != b'KM':
+        sys.exit('no keymap in pad')
+    n = head[4] | head[5] << 8
+    region = bytearray()
+    for offset in range(0, 8 + n, KMAP_BLOCK):
+        region += command(dev, CMD_KMAP_READ, offset // KMAP_BLOCK, count=KMAP_BLOCK)
+    flag = (0x80 if head[3] & KMAP_TAPHOLD else 0) | (0x40 if head[3] & KMAP_CHORDS else 0)
+    return bytes([head[2] | flag]) + bytes(region[8:8 + n])
+
+
+def stats():
+    dev = open_pad()
+    s = command(dev, CMD_STATS)
+    print('input queue overflows:  %d' % (s[0] | s[1] << 8))
+    print('chatter (keys 1-3, knob): %d %d %d %d' % tuple(s[2:6]))
+    print('data flash bytes written: %d' % (s[6] | s[7] << 8))
+    if len(s) > 8:                          # older firmware sends 8 bytes
+        print('report queue overflows: %d' % s[8])
+
+
+def main():
+    if sys.argv[1:] == ['stats']:
+        stats()
+        return
+    commands = ('crc', 'convert', 'push', 'pull', 'push-keymap', 'pull-keymap')
+    if len(sys.argv) != 3 or sys.argv[1] not in commands:
+        sys.exit('usage: flashdata.py %s FILE' % '|'.join(commands))
+    if sys.argv[1] == 'pull':
+        with open(sys.argv[2], 'wb') as f:
+            f.write(pull())
+        return
+    if sys.argv[1] == 'pull-keymap':
+        with open(sys.argv[2], 'wb') as f:
+            f.write(pull_keymap())
+        return
+    if sys.argv[1] == 'push-keymap':
+        with open(sys.argv[2], 'rb') as f:
+            push_keymap(keymap_region(f.read()))
+        return
+    with open(sys.argv[2], 'rb') as f:
+        img = bytearray(f.read().ljust(SIZE, b'\0')[:SIZE])
+    if sys.argv[1] == 'push':
+        if img[0:2] != MAGIC:
+            sys.exit('legacy layout, convert it first')
+        set_crc(img)
+        push(img)
+        return
+    if sys.argv[1] == 'convert':
+        if img[0:2] == MAGIC:
+            sys.exit('already converted')
+        img = convert(img)
+    elif img[0:2] != MAGIC:
+        print('legacy layout, no CRC')
+        return
+    set_crc(img)
+    with open(sys.argv[2], 'wb') as f:
+        f.write(img)
+    print('CRC %04X' % crc16(img[HEADER:SIZE]))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+# ===================================================================================
+# macroc - compile 3keys_1knob macro source into precomputed keyboard reports
+# ===================================================================================
+#
+# Usage:
+#   python3 tools/macroc.py macros.txt keymap.bin
+#
+# Replaces the macro table at the end of keymap.bin and keeps its layer records and
+# sections. A keymap without layers is written if keymap.bin does not exist yet.
+#
+# Source: one statement per line, "#" starts a comment. Macros are numbered from 0
+# in the order of their "macro" statements (the number used with modifier 0xF1).
+#
+#   macro                   start next macro
+#   "text"                  type text (escapes \n, \t, \" and \\)
+#   tap MOD+...+KEY         press and release key with modifiers (ctrl+c, gui+r, f5)
+#   press KEY               hold key or modifier until released
+#   release KEY             let go of key or modifier
+#   consumer KEY            press and release consumer key (vol_up, 0xE9)
+#   delay MS                wait, in steps of 10 ms
+#   layer N                 switch to layer N
+#
+# Key names are those of KBD_KEY_* and CON_* in include/usb_conkbd.h in lower case
+# without prefix (return, f13, left_ctrl, vol_up), ctrl, shift, alt and gui, or a
+# printable character; 0xNN is a keyboard usage sent as is. Text and characters
+# are mapped with KBD_map of include/usb_conkbd.c, as the firmware would type them.
+#
+# Keyboard statements become MAC_KEYS instructions, each a complete report that
+# the firmware copies to the report queue. A key is pressed in the report that
+# still holds the key before it and releases the one before that, so a character
+# costs one report of up to two keys. A separate release is only needed when a key
+# repeats or the modifiers change. Modifiers are pressed with their key and
+# reports equal to the one before are dropped. Each report adds one key at most,
+# so the host keeps the order. All keys are released at the end of a macro.
+
+import os
+import re
+import sys
+import flashdata
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'include')
+
+# Instructions of include/macro.h
+MAC_END, MAC_CONSUMER, MAC_DELAY, MAC_LAYER, MAC_KEYS = 0x00, 0x06, 0x07, 0x08, 0x0A
+MAC_DELAY_ms = 10
+SLOTS = 6                                   # keys in a report
+ROLL = 2                                    # keys of text and taps held at once
+
+MODIFIERS = {'ctrl': 0x01, 'shift': 0x02, 'alt': 0x04, 'gui': 0x08}
+
+
+def firmware_names():
+    with open(os.path.join(ROOT, 'usb_conkbd.h')) as f:
+        defines = re.findall(r'#define\s+(KBD_KEY|CON)_(\w+)\s+(0x[0-9A-Fa-f]+)', f.read())
+    with open(os.path.join(ROOT, 'usb_conkbd.c')) as f:
+        table = re.search(r'KBD_map\[128\]\s*=\s*\{(.*?)\}', f.read(), re.S).group(1)
+    keys = {n.lower(): int(v, 16) for p, n, v in defines if p == 'KBD_KEY'}
+    consumer = {n.lower(): int(v, 16) for p, n, v in defines if p == 'CON'}
+    return keys, consumer, [int(v, 16) for v in table.split(',') if v.strip()]
+
+
+KEYS, CONSUMER, KBD_MAP = firmware_names()
+
+
+class Error(Exception):
+    pass
+
+
+def char(c):
+    """Modifier bits and usage of an ASCII character"""
+    code = KBD_MAP[ord(c)] if ord(c) < 128 else 0
+    if not code:
+        raise Error('no key for %r' % c)
+    return (0x02 if code & 0x80 else 0), code & 0x7F
+
+
+def key(name):
+    """Modifier bits and usage (None for a modifier) of a key name"""
+    low = name.lower()
+    if low in MODIFIERS:
+        return MODIFIERS[low], None
+    if low in KEYS:
+        v = KEYS[low]
+        if v < 136:
+            return 1 << (v - 128), None
+        return 0, v - 136
+    if low.startswith('0x'):
+        return 0, int(low, 16)
+    if len(name) == 1:
+        return char(name)
+    raise Error('unknown key %r' % name)
+
+
+class Macro:
+    def __init__(self):
+        self.code = bytearray()
+        self.reports = 0
+        self.mod, self.keys = 0, []         # held by press
+        self.roll_mod, self.roll = 0, []    # pressed by text and tap
+        self.sent = (0, ())
+
+    def emit(self, mod, keys):
+        if (mod, tuple(keys)) == self.sent:
+            return                          # redundant report
+        self.sent = (mod, tuple(keys))
+        self.code += bytes([MAC_KEYS + len(keys), mod] + keys)
+        self.reports += 1
+
+    def release(self, mod):
+        """Release the keys of text and taps, modifiers mod go out with the next key"""
+        self.roll_mod &= mod                # only those kept by the next key
+        self.roll = []
+        self.emit(self.mod | self.roll_mod, self.keys)
+        self.roll_mod = mod
+
+    def strike(self, mod, usage):
+        if usage is None:                   # modifiers only
+            self.settle()
+            self.emit(self.mod | mod, self.keys)
+            self.emit(self.mod, self.keys)
+            return
+        held = self.keys + self.roll
+        if self.roll and (mod != self.roll_mod or usage in held):
+            self.release(mod)
+        elif not self.roll:
+            self.roll_mod = mod
+        if usage in self.keys or len(self.keys) + ROLL > SLOTS:
+            raise Error('key is held')
+        if len(self.roll) >= ROLL:
+            self.roll.pop(0)                # released with the next press
+        self.roll.append(usage)
+        self.emit(self.mod | mod, self.keys + self.roll)
+
+    def settle(self):
+        if self.roll or self.roll_mod:
+            self.release(0)
+
+    def press(self, mod, usage, down):
+        self.settle()
+        if down:
+            self.mod |= mod
+            if usage is not None and usage not in self.keys:
+                if len(self.keys) >= SLOTS:
+                    raise Error('too many keys held')
+                self.keys.append(usage)
+        else:
+            self.mod &= ~mod
+            if usage in self.keys:
+                self.keys.remove(usage)
+        self.emit(self.mod, self.keys)
+
+    def op(self, *code):
+        self.settle()
+        self.code += bytes(code)
+
+    def end(self):
+        self.settle()
+        self.mod, self.keys = 0, []
+        self.emit(0, [])
+        self.code.append(MAC_END)
+
+
+def combo(arg):
+    mod, usage = 0, None
+    for part in arg.split('+') if arg != '+' else ['+']:
+        m, u = key(part)
+        mod |= m
+        if u is not None:
+            if usage is not None:
+                raise Error('one key per tap')
+            usage = u
+    return mod, usage
+
+
+def number(arg, top):
+    n = int(arg, 0)
+    if not 0 <= n <= top:
+        raise Error('%d out of range' % n)
+    return n
+
+
+def statement(m, line):
+    if line.startswith('"'):
+        if len(line) < 2 or not line.endswith('"'):
+            raise Error('unterminated text')
+        text = line[1:-1].encode().decode('unicode_escape')
+        for c in text:
+            m.strike(*char(c))
+        return
+    word, _, arg = line.partition(' ')
+    arg = arg.strip()
+    if word == 'tap':
+        m.strike(*combo(arg))
+    elif word in ('press', 'release'):
+        m.press(*key(arg), down=(word == 'press'))
+    elif word == 'consumer':
+        usage = CONSUMER[arg.lower()] if arg.lower() in CONSUMER else number(arg, 0xFFFF)
+        m.op(MAC_CONSUMER, usage & 0xFF, usage >> 8)
+    elif word == 'delay':
+        steps = (number(arg, 0xFFFF) + MAC_DELAY_ms // 2) // MAC_DELAY_ms
+        while steps:
+            m.op(MAC_DELAY, min(steps, 255))
+            steps -= min(steps, 255)
+    elif word == 'layer':
+        m.op(MAC_LAYER, number(arg, 15))
+    else:
+        raise Error('unknown statement %r' % word)
+
+
+def compile_macros(source):
+    """Macros of source, exits on errors
+
+    >>> [m.code.hex(' ') for m in compile_macros('macro\\ntap ctrl+c')]
+    ['0b 01 06 0a 00 00']
+    >>> [m.code.hex(' ') for m in compile_macros('macro\\n"ab"\\ntap ctrl+c')]
+    ['0b 00 04 0c 00 04 05 0a 00 0b 01 06 0a 00 00']
+    >>> [m.code.hex(' ') for m in compile_macros('macro\\n"aB"')]
+    ['0b 00 04 0a 00 0b 02 05 0a 00 00']
+    """
+    macros = []
+    for n, line in enumerate(source.splitlines(), 1):
+        line = line.strip()
+        if not line or line.startswith('#'):
+            continue
+        try:
+            if line == 'macro':
+                macros.append(Macro())
+            elif not macros:
+                raise Error('statement before first macro')
+            else:
+                statement(macros[-1], line)
+        except (Error, ValueError) as e:
+            sys.exit('line %d: %s' % (n, e))
+    for m in macros:
+        m.end()
+    return macros
+
+
+def keymap_head(path):
+    """Layer records and sections of an existing keymap.bin"""
+    if not os.path.exists(path):
+        return b'\0'
+    with open(path, 'rb') as f:
+        data = f.read()
+    size = 1 + (data[0] & 0x3F) * flashdata.LAYER
+    size += flashdata.TAPHOLD_SIZE if data[0] & 0x80 else 0
+    size += flashdata.CHORDS_SIZE if data[0] & 0x40 else 0
+    if size > len(data):
+        sys.exit('keymap too short')
+    return data[:size]
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: macroc.py macros.txt keymap.bin')
+    with open(sys.argv[1]) as f:
+        macros = compile_macros(f.read())
+    table = b''.join(bytes(m.code) for m in macros)
+    data = keymap_head(sys.argv[2]) + table
+    flashdata.keymap_region(data)           # exits if it does not fit
+    with open(sys.argv[2], 'wb') as f:
+        f.write(data)
+    for n, m in enumerate(macros):
+        print('macro %d: %d reports, %d bytes' % (n, m.reports, len(m.code)))
+
+
+if __name__ == '__main__':
+    main()